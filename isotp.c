@@ -2,6 +2,12 @@
 #include "assert.h"
 #include "isotp.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
 ///////////////////////////////////////////////////////
 ///                 STATIC FUNCTIONS                ///
 ///////////////////////////////////////////////////////
@@ -33,6 +39,115 @@ static uint8_t isotp_st_min_to_ms(uint8_t st_min) {
     return ms;
 }
 
+/* scheduler tokens are counted in thousandths of a frame */
+#define ISOTP_SCHEDULER_FRAME_COST 1000
+
+/* block_map marker for blocks inside an allocation, other than its first one */
+#define ISOTP_POOL_BLOCK_TAIL 0xFFFF
+
+/* take size bytes of consecutive blocks from pool, first fit */
+static uint8_t* isotp_buffer_pool_alloc(IsoTpBufferPool *pool, uint16_t size) {
+    uint16_t needed;
+    uint16_t start;
+    uint16_t i;
+
+    needed = (uint16_t) ((size + pool->block_size - 1) / pool->block_size);
+    if (0 == needed) {
+        needed = 1;
+    }
+
+    start = 0;
+    while (start + needed <= pool->block_count) {
+        /* skip allocated runs */
+        if (0 != pool->block_map[start]) {
+            start += pool->block_map[start];
+            continue;
+        }
+
+        /* check if the run is free */
+        for (i = 1; i < needed; i++) {
+            if (0 != pool->block_map[start + i]) {
+                break;
+            }
+        }
+
+        if (i == needed) {
+            pool->block_map[start] = needed;
+            for (i = 1; i < needed; i++) {
+                pool->block_map[start + i] = ISOTP_POOL_BLOCK_TAIL;
+            }
+            return pool->memory + (uint32_t) start * pool->block_size;
+        }
+
+        /* continue behind the allocated block */
+        start += i;
+    }
+
+    return 0x0;
+}
+
+/* return blocks taken with isotp_buffer_pool_alloc */
+static void isotp_buffer_pool_free(IsoTpBufferPool *pool, uint8_t *buffer) {
+    uint16_t start;
+    uint16_t count;
+    uint16_t i;
+
+    start = (uint16_t) ((buffer - pool->memory) / pool->block_size);
+    count = pool->block_map[start];
+    for (i = 0; i < count; i++) {
+        pool->block_map[start + i] = 0;
+    }
+}
+
+/* make sure the link has a receive buffer for size bytes */
+static int isotp_receive_buffer_acquire(IsoTpLink *link, uint16_t size) {
+    /* link owns a dedicated buffer */
+    if (0x0 == link->receive_pool) {
+        return ISOTP_RET_OK;
+    }
+
+    /* drop the previous message, if any */
+    if (0x0 != link->receive_buffer) {
+        isotp_buffer_pool_free(link->receive_pool, link->receive_buffer);
+    }
+
+    link->receive_buffer = isotp_buffer_pool_alloc(link->receive_pool, size);
+    if (0x0 == link->receive_buffer) {
+        isotp_user_debug("Receive buffer pool exhausted.");
+        return ISOTP_RET_NO_BUFFER;
+    }
+
+    return ISOTP_RET_OK;
+}
+
+/* give the receive buffer back to the pool, if taken from one */
+static void isotp_receive_buffer_release(IsoTpLink *link) {
+    if (0x0 != link->receive_pool && 0x0 != link->receive_buffer) {
+        isotp_buffer_pool_free(link->receive_pool, link->receive_buffer);
+        link->receive_buffer = 0x0;
+    }
+}
+
+/* hand a frame to the driver, charging the link's scheduler for it */
+static int isotp_send_can(IsoTpLink *link, uint32_t id, const uint8_t *data, uint8_t size) {
+    IsoTpScheduler *scheduler = link->send_scheduler;
+    int32_t floor;
+    int ret;
+
+    ret = isotp_user_send_can(id, data, size);
+
+    /* only a bus-load limit counts frames, flow control frames may overdraw it by one burst */
+    if (ISOTP_RET_OK == ret && 0x0 != scheduler && 0 != scheduler->frames_per_second) {
+        scheduler->tokens -= ISOTP_SCHEDULER_FRAME_COST;
+        floor = -(int32_t) scheduler->burst * ISOTP_SCHEDULER_FRAME_COST;
+        if (scheduler->tokens < floor) {
+            scheduler->tokens = floor;
+        }
+    }
+
+    return ret;
+}
+
 static int isotp_send_flow_control(IsoTpLink* link, uint8_t flow_status, uint8_t block_size, uint8_t st_min_ms) {
 
     IsoTpCanMessage message;
@@ -47,9 +162,9 @@ static int isotp_send_flow_control(IsoTpLink* link, uint8_t flow_status, uint8_t
     /* send message */
 #ifdef ISO_TP_FRAME_PADDING
     (void) memset(message.as.flow_control.reserve, 0, sizeof(message.as.flow_control.reserve));
-    ret = isotp_user_send_can(link->send_arbitration_id, message.as.data_array.ptr, sizeof(message));
+    ret = isotp_send_can(link, link->send_arbitration_id, message.as.data_array.ptr, sizeof(message));
 #else    
-    ret = isotp_user_send_can(link->send_arbitration_id,
+    ret = isotp_send_can(link, link->send_arbitration_id,
             message.as.data_array.ptr,
             3);
 #endif
@@ -57,6 +172,139 @@ static int isotp_send_flow_control(IsoTpLink* link, uint8_t flow_status, uint8_t
     return ret;
 }
 
+static void isotp_gateway_abort(IsoTpGateway *gateway, int protocol_result);
+
+/* notify the application of a failed transfer */
+static void isotp_notify_error(IsoTpLink *link, int protocol_result) {
+    if (0x0 != link->callbacks && 0x0 != link->callbacks->protocol_error) {
+        link->callbacks->protocol_error(link, protocol_result, link->callback_data);
+    }
+}
+
+/* finish the running transmission */
+static void isotp_send_complete(IsoTpLink *link) {
+    link->send_status = ISOTP_SEND_STATUS_IDLE;
+    link->send_gateway = 0x0;
+    link->send_cache = 0x0;
+    if (0x0 != link->callbacks && 0x0 != link->callbacks->tx_complete) {
+        link->callbacks->tx_complete(link, link->callback_data);
+    }
+}
+
+/* abort the running transmission */
+static void isotp_send_abort(IsoTpLink *link, int protocol_result) {
+    link->send_protocol_result = protocol_result;
+    link->send_status = ISOTP_SEND_STATUS_ERROR;
+    link->send_cache = 0x0;
+    isotp_notify_error(link, protocol_result);
+
+    /* a forwarded message can not be completed either */
+    if (0x0 != link->send_gateway) {
+        isotp_gateway_abort(link->send_gateway, protocol_result);
+    }
+}
+
+/* a complete message is in the receive buffer */
+static void isotp_receive_complete(IsoTpLink *link) {
+    link->receive_status = ISOTP_RECEIVE_STATUS_FULL;
+    if (0x0 != link->callbacks && 0x0 != link->callbacks->rx_complete) {
+        link->callbacks->rx_complete(link, link->receive_size, link->callback_data);
+    }
+}
+
+/* abort the running reception */
+static void isotp_receive_abort(IsoTpLink *link, int protocol_result) {
+    link->receive_protocol_result = protocol_result;
+    link->receive_status = ISOTP_RECEIVE_STATUS_IDLE;
+    link->receive_fc_pending = 0;
+    isotp_receive_buffer_release(link);
+    isotp_notify_error(link, protocol_result);
+
+    /* stop forwarding the message */
+    if (0x0 != link->receive_gateway) {
+        isotp_gateway_abort(link->receive_gateway, protocol_result);
+    }
+}
+
+/* send a flow control frame, keeping it pending while the driver is busy */
+static int isotp_queue_flow_control(IsoTpLink *link, uint8_t flow_status, uint8_t block_size, uint8_t st_min_ms) {
+    int ret;
+
+    ret = isotp_send_flow_control(link, flow_status, block_size, st_min_ms);
+
+    if (ISOTP_RET_BUSY == ret) {
+        /* N_Ar starts with the first attempt */
+        if (0 == link->receive_fc_pending) {
+            link->receive_timer_ar = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+        }
+        link->receive_fc_pending = 1;
+        link->receive_fc_status = flow_status;
+        link->receive_fc_bs = block_size;
+        link->receive_fc_st_min = st_min_ms;
+    } else {
+        link->receive_fc_pending = 0;
+        if (ISOTP_RET_OK != ret && ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status) {
+            isotp_receive_abort(link, ISOTP_PROTOCOL_RESULT_ERROR);
+        }
+    }
+
+    return ret;
+}
+
+/* stop forwarding, failing the side that is still running */
+static void isotp_gateway_abort(IsoTpGateway *gateway, int protocol_result) {
+    IsoTpLink *source = gateway->source;
+    IsoTpLink *target = gateway->target;
+
+    /* not forwarding */
+    if (target->send_gateway != gateway) {
+        return;
+    }
+
+    target->send_gateway = 0x0;
+    gateway->frame_used = 0;
+    gateway->credit = 0;
+    gateway->pending_len = 0;
+
+    if (ISOTP_SEND_STATUS_INPROGRESS == target->send_status) {
+        isotp_send_abort(target, protocol_result);
+    }
+    if (ISOTP_RECEIVE_STATUS_INPROGRESS == source->receive_status) {
+        isotp_receive_abort(source, protocol_result);
+        /* send error message, after the abort so that a refused one is retried */
+        isotp_queue_flow_control(source, PCI_FLOW_STATUS_OVERFLOW, 0, 0);
+    }
+}
+
+/* accept a multi-frame reception whose first frame is in the receive buffer */
+static void isotp_receive_accept(IsoTpLink *link) {
+    /* change status */
+    link->receive_status = ISOTP_RECEIVE_STATUS_INPROGRESS;
+    /* send fc frame */
+    link->receive_bs_count = ISO_TP_DEFAULT_BLOCK_SIZE;
+    isotp_queue_flow_control(link, PCI_FLOW_STATUS_CONTINUE, link->receive_bs_count, ISO_TP_DEFAULT_ST_MIN);
+    /* refresh timer cs */
+    link->receive_timer_cr = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+
+    /* flow control frame may have failed */
+    if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status &&
+        0x0 != link->callbacks && 0x0 != link->callbacks->rx_first_frame) {
+        link->callbacks->rx_first_frame(link, link->receive_size, link->callback_data);
+    }
+}
+
+/* init multi-frame control flags once the first frame is out */
+static void isotp_send_start(IsoTpLink *link) {
+    link->send_bs_remain = 0;
+    link->send_st_min = 0;
+    link->send_wtf_count = 0;
+    link->send_pending = 0;
+    link->send_timer_st = isotp_user_get_ms();
+    link->send_timer_bs = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+    link->send_protocol_result = ISOTP_PROTOCOL_RESULT_OK;
+    link->send_status = ISOTP_SEND_STATUS_INPROGRESS;
+}
+
 static int isotp_send_single_frame(IsoTpLink* link, uint32_t id) {
 
     IsoTpCanMessage message;
@@ -73,9 +321,9 @@ static int isotp_send_single_frame(IsoTpLink* link, uint32_t id) {
     /* send message */
 #ifdef ISO_TP_FRAME_PADDING
     (void) memset(message.as.single_frame.data + link->send_size, 0, sizeof(message.as.single_frame.data) - link->send_size);
-    ret = isotp_user_send_can(id, message.as.data_array.ptr, sizeof(message));
+    ret = isotp_send_can(link, id, message.as.data_array.ptr, sizeof(message));
 #else
-    ret = isotp_user_send_can(id,
+    ret = isotp_send_can(link, id,
             message.as.data_array.ptr,
             link->send_size + 1);
 #endif
@@ -98,7 +346,7 @@ static int isotp_send_first_frame(IsoTpLink* link, uint32_t id) {
     (void) memcpy(message.as.first_frame.data, link->send_buffer, sizeof(message.as.first_frame.data));
 
     /* send message */
-    ret = isotp_user_send_can(id, message.as.data_array.ptr, sizeof(message));
+    ret = isotp_send_can(link, id, message.as.data_array.ptr, sizeof(message));
     if (ISOTP_RET_OK == ret) {
         link->send_offset += sizeof(message.as.first_frame.data);
         link->send_sn = 1;
@@ -110,47 +358,82 @@ static int isotp_send_first_frame(IsoTpLink* link, uint32_t id) {
 static int isotp_send_consecutive_frame(IsoTpLink* link) {
     
     IsoTpCanMessage message;
+    const uint8_t *data;
     uint16_t data_length;
+    uint16_t index;
     int ret;
 
     /* multi frame message length must greater than 7  */
     assert(link->send_size > 7);
 
-    /* setup message  */
-    message.as.consecutive_frame.type = TSOTP_PCI_TYPE_CONSECUTIVE_FRAME;
-    message.as.consecutive_frame.SN = link->send_sn;
     data_length = link->send_size - link->send_offset;
     if (data_length > sizeof(message.as.consecutive_frame.data)) {
         data_length = sizeof(message.as.consecutive_frame.data);
     }
-    (void) memcpy(message.as.consecutive_frame.data, link->send_buffer + link->send_offset, data_length);
 
-    /* send message */
+    /* a cached message is sent as encoded, the frame follows from the offset */
+    if (0x0 != link->send_cache) {
+        index = 1 + (link->send_offset - sizeof(message.as.first_frame.data)) / sizeof(message.as.consecutive_frame.data);
+        ret = isotp_send_can(link, link->send_arbitration_id,
+                link->send_cache->frames + (uint32_t) index * sizeof(message),
+                index + 1 < link->send_cache->frame_count ? sizeof(message) : link->send_cache->last_frame_size);
+    } else {
+        /* setup message  */
+        message.as.consecutive_frame.type = TSOTP_PCI_TYPE_CONSECUTIVE_FRAME;
+        message.as.consecutive_frame.SN = link->send_sn;
+
+        /* a forwarded message is taken from the gateway, as far as received */
+        if (0x0 != link->send_gateway) {
+            if (0 == link->send_gateway->frame_used) {
+                return ISOTP_RET_NO_DATA;
+            }
+            data = link->send_gateway->frames + (uint32_t) link->send_gateway->frame_head * sizeof(message.as.consecutive_frame.data);
+        } else {
+            data = link->send_buffer + link->send_offset;
+        }
+        (void) memcpy(message.as.consecutive_frame.data, data, data_length);
+
+        /* send message */
 #ifdef ISO_TP_FRAME_PADDING
-    (void) memset(message.as.consecutive_frame.data + data_length, 0, sizeof(message.as.consecutive_frame.data) - data_length);
-    ret = isotp_user_send_can(link->send_arbitration_id, message.as.data_array.ptr, sizeof(message));
+        (void) memset(message.as.consecutive_frame.data + data_length, 0, sizeof(message.as.consecutive_frame.data) - data_length);
+        ret = isotp_send_can(link, link->send_arbitration_id, message.as.data_array.ptr, sizeof(message));
 #else
-    ret = isotp_user_send_can(link->send_arbitration_id,
-            message.as.data_array.ptr,
-            data_length + 1);
+        ret = isotp_send_can(link, link->send_arbitration_id,
+                message.as.data_array.ptr,
+                data_length + 1);
 #endif
+    }
     if (ISOTP_RET_OK == ret) {
         link->send_offset += data_length;
         if (++(link->send_sn) > 0x0F) {
             link->send_sn = 0;
         }
+        if (0x0 != link->send_gateway) {
+            if (++(link->send_gateway->frame_head) >= link->send_gateway->frame_count) {
+                link->send_gateway->frame_head = 0;
+            }
+            link->send_gateway->frame_used -= 1;
+        }
     }
     
     return ret;
 }
 
 static int isotp_receive_single_frame(IsoTpLink *link, IsoTpCanMessage *message, uint8_t len) {
+    int ret;
+
     /* check data length */
     if ((0 == message->as.single_frame.SF_DL) || (message->as.single_frame.SF_DL > (len - 1))) {
         isotp_user_debug("Single-frame length too small.");
         return ISOTP_RET_LENGTH;
     }
 
+    /* get buffer */
+    ret = isotp_receive_buffer_acquire(link, message->as.single_frame.SF_DL);
+    if (ISOTP_RET_OK != ret) {
+        return ret;
+    }
+
     /* copying data */
     (void) memcpy(link->receive_buffer, message->as.single_frame.data, message->as.single_frame.SF_DL);
     link->receive_size = message->as.single_frame.SF_DL;
@@ -158,8 +441,18 @@ static int isotp_receive_single_frame(IsoTpLink *link, IsoTpCanMessage *message,
     return ISOTP_RET_OK;
 }
 
+/* start multi-frame reception into the receive buffer */
+static void isotp_receive_start(IsoTpLink *link, uint16_t payload_length, const uint8_t *ff_data) {
+    (void) memcpy(link->receive_buffer, ff_data, sizeof(link->receive_wait_data));
+    link->receive_size = payload_length;
+    link->receive_offset = sizeof(link->receive_wait_data);
+    link->receive_sn = 1;
+    link->receive_wait_size = 0;
+}
+
 static int isotp_receive_first_frame(IsoTpLink *link, IsoTpCanMessage *message, uint8_t len) {
     uint16_t payload_length;
+    int ret;
 
     if (8 != len) {
         isotp_user_debug("First frame should be 8 bytes in length.");
@@ -180,12 +473,23 @@ static int isotp_receive_first_frame(IsoTpLink *link, IsoTpCanMessage *message,
         isotp_user_debug("Multi-frame response too large for receiving buffer.");
         return ISOTP_RET_OVERFLOW;
     }
+
+    /* get buffer, the previous message must have been read before when flow control may wait */
+    if (ISO_TP_RECEIVE_MAX_WFT_NUMBER > 0 && ISOTP_RECEIVE_STATUS_FULL == link->receive_status) {
+        ret = ISOTP_RET_NO_BUFFER;
+    } else {
+        ret = isotp_receive_buffer_acquire(link, payload_length);
+    }
+
+    /* keep the first frame until a buffer becomes available */
+    if (ISOTP_RET_NO_BUFFER == ret) {
+        (void) memcpy(link->receive_wait_data, message->as.first_frame.data, sizeof(link->receive_wait_data));
+        link->receive_wait_size = payload_length;
+        return ret;
+    }
     
     /* copying data */
-    (void) memcpy(link->receive_buffer, message->as.first_frame.data, sizeof(message->as.first_frame.data));
-    link->receive_size = payload_length;
-    link->receive_offset = sizeof(message->as.first_frame.data);
-    link->receive_sn = 1;
+    isotp_receive_start(link, payload_length, message->as.first_frame.data);
 
     return ISOTP_RET_OK;
 }
@@ -229,155 +533,751 @@ static int isotp_receive_flow_control_frame(IsoTpLink *link, IsoTpCanMessage *me
     return ISOTP_RET_OK;
 }
 
-///////////////////////////////////////////////////////
-///                 PUBLIC FUNCTIONS                ///
-///////////////////////////////////////////////////////
+/* let the source send as many frames as the buffer holds and the target's receiver accepts */
+static void isotp_gateway_grant(IsoTpGateway *gateway) {
+    IsoTpLink *source = gateway->source;
+    IsoTpLink *target = gateway->target;
+    uint16_t remaining;
+    uint16_t grant;
+    uint8_t st_min;
 
-int isotp_send(IsoTpLink *link, const uint8_t payload[], uint16_t size) {
-    return isotp_send_with_id(link, link->send_arbitration_id, payload, size);
+    if (target->send_gateway != gateway ||
+        ISOTP_RECEIVE_STATUS_INPROGRESS != source->receive_status || 0 != gateway->credit) {
+        return;
+    }
+
+    /* frames the source has yet to send */
+    remaining = (uint16_t) ((source->receive_size - source->receive_offset + 6) / 7);
+
+    grant = (uint16_t) (gateway->frame_count - gateway->frame_used);
+    if (grant > remaining) {
+        grant = remaining;
+    }
+
+    /* buffered frames count against the target's current block */
+    if (ISOTP_INVALID_BS != target->send_bs_remain) {
+        if (target->send_bs_remain > gateway->frame_used) {
+            if (grant > target->send_bs_remain - gateway->frame_used) {
+                grant = (uint16_t) (target->send_bs_remain - gateway->frame_used);
+            }
+        } else {
+            grant = 0;
+        }
+    }
+    if (grant > 0xFF) {
+        grant = 0xFF;
+    }
+
+    if (0 == grant) {
+        return;
+    }
+
+    /* source must not be faster than the target's receiver */
+    st_min = target->send_st_min;
+    if (st_min < ISO_TP_DEFAULT_ST_MIN) {
+        st_min = ISO_TP_DEFAULT_ST_MIN;
+    }
+
+    gateway->credit = grant;
+    source->receive_wft_count = 0;
+    source->receive_timer_cr = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+    isotp_queue_flow_control(source, PCI_FLOW_STATUS_CONTINUE, (uint8_t) grant, st_min);
 }
 
-int isotp_send_with_id(IsoTpLink *link, uint32_t id, const uint8_t payload[], uint16_t size) {
+/* check if flow control permits the next consecutive frame now */
+static int isotp_send_ready(IsoTpLink *link) {
+    return ISOTP_SEND_STATUS_INPROGRESS == link->send_status &&
+        /* send data if bs_remain is invalid or bs_remain large than zero */
+        (ISOTP_INVALID_BS == link->send_bs_remain || link->send_bs_remain > 0) &&
+        /* and if st_min is zero or go beyond interval time */
+        (0 == link->send_st_min || (0 != link->send_st_min && IsoTpTimeAfter(isotp_user_get_ms(), link->send_timer_st)));
+}
+
+/* send the next consecutive frame and update flow control state */
+static int isotp_send_next(IsoTpLink *link) {
     int ret;
 
-    if (link == 0x0) {
-        isotp_user_debug("Link is null!");
-        return ISOTP_RET_ERROR;
-    }
+    ret = isotp_send_consecutive_frame(link);
+    if (ISOTP_RET_OK == ret) {
+        if (ISOTP_INVALID_BS != link->send_bs_remain) {
+            link->send_bs_remain -= 1;
+        }
+        link->send_timer_bs = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+        link->send_timer_st = isotp_user_get_ms() + link->send_st_min;
 
-    if (size > link->send_buf_size) {
-        isotp_user_debug("Message size too large. Increase ISO_TP_MAX_MESSAGE_SIZE to set a larger buffer\n");
-        char message[128];
-        sprintf(&message[0], "Attempted to send %d bytes; max size is %d!\n", size, link->send_buf_size);
-        return ISOTP_RET_OVERFLOW;
+        link->send_pending = 0;
+
+        /* check if send finish */
+        if (link->send_offset >= link->send_size) {
+            isotp_send_complete(link);
+        } else if (0x0 != link->send_gateway) {
+            /* frame buffer has room again */
+            isotp_gateway_grant(link->send_gateway);
+        }
+    } else if (ISOTP_RET_BUSY == ret) {
+        /* keep the frame pending, N_As starts with the first attempt */
+        if (0 == link->send_pending) {
+            link->send_pending = 1;
+            link->send_timer_as = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+        } else if (IsoTpTimeAfter(isotp_user_get_ms(), link->send_timer_as)) {
+            isotp_send_abort(link, ISOTP_PROTOCOL_RESULT_TIMEOUT_A);
+        }
+    } else if (ISOTP_RET_NO_DATA != ret) {
+        isotp_send_abort(link, ISOTP_PROTOCOL_RESULT_ERROR);
     }
 
+    return ret;
+}
+
+/* send consecutive frames as permitted by flow control */
+static void isotp_send_poll(IsoTpLink *link) {
+
+    /* only polling when operation in progress */
     if (ISOTP_SEND_STATUS_INPROGRESS == link->send_status) {
-        isotp_user_debug("Abort previous message, transmission in progress.\n");
-        return ISOTP_RET_INPROGRESS;
+
+        /* continue send data, scheduled links are served by their scheduler */
+        if (0x0 == link->send_scheduler && isotp_send_ready(link)) {
+            (void) isotp_send_next(link);
+        }
+
+        /* check timeout, a pending frame is covered by N_As; a forwarded or scheduled one is
+           delayed by this node, only the wait for flow control is timed */
+        if (ISOTP_SEND_STATUS_INPROGRESS == link->send_status && 0 == link->send_pending &&
+            ((0x0 == link->send_gateway && 0x0 == link->send_scheduler) || 0 == link->send_bs_remain) &&
+            (0x0 == link->send_gateway || 0 == link->send_gateway->pending_len) &&
+            IsoTpTimeAfter(isotp_user_get_ms(), link->send_timer_bs)) {
+            isotp_send_abort(link, ISOTP_PROTOCOL_RESULT_TIMEOUT_BS);
+        }
     }
 
-    /* copy into local buffer */
-    link->send_size = size;
-    link->send_offset = 0;
-    (void) memcpy(link->send_buffer, payload, size);
+    return;
+}
 
-    if (link->send_size < 8) {
-        /* send single frame */
-        ret = isotp_send_single_frame(link, id);
-    } else {
-        /* send multi-frame */
-        ret = isotp_send_first_frame(link, id);
+/* forward a single or first frame, keeping it pending while the target's driver is busy */
+static int isotp_gateway_forward(IsoTpGateway *gateway, const uint8_t *data, uint8_t len) {
+    IsoTpLink *target = gateway->target;
+    int ret;
 
-        /* init multi-frame control flags */
-        if (ISOTP_RET_OK == ret) {
-            link->send_bs_remain = 0;
-            link->send_st_min = 0;
-            link->send_wtf_count = 0;
-            link->send_timer_st = isotp_user_get_ms();
-            link->send_timer_bs = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
-            link->send_protocol_result = ISOTP_PROTOCOL_RESULT_OK;
-            link->send_status = ISOTP_SEND_STATUS_INPROGRESS;
-        }
+    ret = isotp_send_can(target, target->send_arbitration_id, data, len);
+    if (ISOTP_RET_BUSY == ret) {
+        /* N_As starts with the first attempt */
+        (void) memcpy(gateway->pending_frame, data, len);
+        gateway->pending_len = len;
+        gateway->timer_as = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+        ret = ISOTP_RET_OK;
     }
 
     return ret;
 }
 
-void isotp_on_can_message(IsoTpLink *link, uint8_t *data, uint8_t len) {
-    IsoTpCanMessage message;
+/* retry the frame the target's driver refused */
+static void isotp_gateway_retry(IsoTpGateway *gateway) {
+    IsoTpLink *target = gateway->target;
+    int first_frame;
     int ret;
-    
-    if (len < 2 || len > 8) {
+
+    /* a first frame has started the target's transmission */
+    first_frame = target->send_gateway == gateway;
+
+    ret = isotp_send_can(target, target->send_arbitration_id, gateway->pending_frame, gateway->pending_len);
+    if (ISOTP_RET_BUSY == ret && !IsoTpTimeAfter(isotp_user_get_ms(), gateway->timer_as)) {
         return;
     }
 
-    memcpy(message.as.data_array.ptr, data, len);
-    memset(message.as.data_array.ptr + len, 0, sizeof(message.as.data_array.ptr) - len);
+    gateway->pending_len = 0;
+    if (ISOTP_RET_OK == ret) {
+        /* N_Bs starts when the first frame is out */
+        if (first_frame) {
+            target->send_timer_bs = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+        }
+    } else if (first_frame) {
+        isotp_gateway_abort(gateway, ISOTP_RET_BUSY == ret ? ISOTP_PROTOCOL_RESULT_TIMEOUT_A : ISOTP_PROTOCOL_RESULT_ERROR);
+    } else {
+        isotp_notify_error(gateway->source, ISOTP_RET_BUSY == ret ? ISOTP_PROTOCOL_RESULT_TIMEOUT_A : ISOTP_PROTOCOL_RESULT_ERROR);
+    }
+}
 
-    switch (message.as.common.type) {
+/* handle a frame received by a gateway's source */
+static void isotp_gateway_on_can_message(IsoTpGateway *gateway, IsoTpCanMessage *message, uint8_t len) {
+    IsoTpLink *source = gateway->source;
+    IsoTpLink *target = gateway->target;
+    uint16_t payload_length;
+    uint16_t data_length;
+    uint16_t slot;
+    int ret;
+
+    switch (message->as.common.type) {
         case ISOTP_PCI_TYPE_SINGLE: {
-            /* update protocol result */
-            if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status) {
-                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_UNEXP_PDU;
-            } else {
-                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_OK;
+            if ((0 == message->as.single_frame.SF_DL) || (message->as.single_frame.SF_DL > (len - 1))) {
+                isotp_user_debug("Single-frame length too small.");
+                break;
             }
 
-            /* handle message */
-            ret = isotp_receive_single_frame(link, &message, len);
-            
-            if (ISOTP_RET_OK == ret) {
-                /* change status */
-                link->receive_status = ISOTP_RECEIVE_STATUS_FULL;
+            /* sender gave up the previous message */
+            if (ISOTP_RECEIVE_STATUS_INPROGRESS == source->receive_status) {
+                isotp_receive_abort(source, ISOTP_PROTOCOL_RESULT_UNEXP_PDU);
+            }
+
+            if (ISOTP_SEND_STATUS_INPROGRESS == target->send_status || 0 != gateway->pending_len) {
+                isotp_user_debug("Gateway target busy, single frame dropped.");
+                isotp_notify_error(source, ISOTP_PROTOCOL_RESULT_BUFFER_OVFLW);
+                break;
+            }
+
+            /* forward as is */
+            ret = isotp_gateway_forward(gateway, message->as.data_array.ptr, len);
+            if (ISOTP_RET_OK != ret) {
+                isotp_notify_error(source, ISOTP_PROTOCOL_RESULT_ERROR);
             }
             break;
         }
         case ISOTP_PCI_TYPE_FIRST_FRAME: {
-            /* update protocol result */
-            if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status) {
-                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_UNEXP_PDU;
-            } else {
-                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_OK;
+            if (8 != len) {
+                isotp_user_debug("First frame should be 8 bytes in length.");
+                break;
             }
 
-            /* handle message */
-            ret = isotp_receive_first_frame(link, &message, len);
-
-            /* if overflow happened */
-            if (ISOTP_RET_OVERFLOW == ret) {
-                /* update protocol result */
-                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_BUFFER_OVFLW;
-                /* change status */
-                link->receive_status = ISOTP_RECEIVE_STATUS_IDLE;
-                /* send error message */
-                isotp_send_flow_control(link, PCI_FLOW_STATUS_OVERFLOW, 0, 0);
+            payload_length = message->as.first_frame.FF_DL_high;
+            payload_length = (payload_length << 8) + message->as.first_frame.FF_DL_low;
+            if (payload_length <= 7) {
+                isotp_user_debug("Should not use multiple frame transmission.");
                 break;
             }
 
-            /* if receive successful */
-            if (ISOTP_RET_OK == ret) {
-                /* change status */
-                link->receive_status = ISOTP_RECEIVE_STATUS_INPROGRESS;
-                /* send fc frame */
-                link->receive_bs_count = ISO_TP_DEFAULT_BLOCK_SIZE;
-                isotp_send_flow_control(link, PCI_FLOW_STATUS_CONTINUE, link->receive_bs_count, ISO_TP_DEFAULT_ST_MIN);
-                /* refresh timer cs */
-                link->receive_timer_cr = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+            /* sender gave up the previous message */
+            if (ISOTP_RECEIVE_STATUS_INPROGRESS == source->receive_status) {
+                isotp_receive_abort(source, ISOTP_PROTOCOL_RESULT_UNEXP_PDU);
             }
-            
+
+            /* forward as is, the target's receiver answers with flow control */
+            if (ISOTP_SEND_STATUS_INPROGRESS == target->send_status || 0 != gateway->pending_len) {
+                isotp_user_debug("Gateway target busy.");
+                ret = ISOTP_RET_INPROGRESS;
+            } else {
+                ret = isotp_gateway_forward(gateway, message->as.data_array.ptr, len);
+            }
+            if (ISOTP_RET_OK != ret) {
+                isotp_queue_flow_control(source, PCI_FLOW_STATUS_OVERFLOW, 0, 0);
+                source->receive_protocol_result = ISOTP_PROTOCOL_RESULT_BUFFER_OVFLW;
+                isotp_notify_error(source, ISOTP_PROTOCOL_RESULT_BUFFER_OVFLW);
+                break;
+            }
+
+            source->receive_size = payload_length;
+            source->receive_offset = sizeof(message->as.first_frame.data);
+            source->receive_sn = 1;
+            source->receive_wft_count = 0;
+            source->receive_protocol_result = ISOTP_PROTOCOL_RESULT_OK;
+            source->receive_status = ISOTP_RECEIVE_STATUS_INPROGRESS;
+
+            target->send_size = payload_length;
+            target->send_offset = sizeof(message->as.first_frame.data);
+            target->send_sn = 1;
+            target->send_gateway = gateway;
+            isotp_send_start(target);
+
+            /* source gets flow control when the target's receiver has sent its own,
+               until then it is kept waiting or given up once N_Cr has passed */
+            gateway->frame_head = 0;
+            gateway->frame_used = 0;
+            gateway->credit = 0;
+            gateway->timer_wait = isotp_user_get_ms() + ISO_TP_RECEIVE_WAIT_INTERVAL;
+            source->receive_timer_cr = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
             break;
         }
         case TSOTP_PCI_TYPE_CONSECUTIVE_FRAME: {
-            /* check if in receiving status */
-            if (ISOTP_RECEIVE_STATUS_INPROGRESS != link->receive_status) {
-                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_UNEXP_PDU;
+            if (ISOTP_RECEIVE_STATUS_INPROGRESS != source->receive_status || target->send_gateway != gateway) {
+                source->receive_protocol_result = ISOTP_PROTOCOL_RESULT_UNEXP_PDU;
+                isotp_notify_error(source, ISOTP_PROTOCOL_RESULT_UNEXP_PDU);
                 break;
             }
 
-            /* handle message */
-            ret = isotp_receive_consecutive_frame(link, &message, len);
+            if (source->receive_sn != message->as.consecutive_frame.SN) {
+                isotp_receive_abort(source, ISOTP_PROTOCOL_RESULT_WRONG_SN);
+                break;
+            }
 
-            /* if wrong sn */
-            if (ISOTP_RET_WRONG_SN == ret) {
-                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_WRONG_SN;
-                link->receive_status = ISOTP_RECEIVE_STATUS_IDLE;
+            /* more frames than granted */
+            if (0 == gateway->credit) {
+                isotp_receive_abort(source, ISOTP_PROTOCOL_RESULT_UNEXP_PDU);
                 break;
             }
 
-            /* if success */
-            if (ISOTP_RET_OK == ret) {
-                /* refresh timer cs */
-                link->receive_timer_cr = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
-                
+            data_length = source->receive_size - source->receive_offset;
+            if (data_length > sizeof(message->as.consecutive_frame.data)) {
+                data_length = sizeof(message->as.consecutive_frame.data);
+            }
+            if (data_length > len - 1) {
+                isotp_user_debug("Consecutive frame too short.");
+                break;
+            }
+
+            /* buffer the frame */
+            slot = gateway->frame_head + gateway->frame_used;
+            if (slot >= gateway->frame_count) {
+                slot -= gateway->frame_count;
+            }
+            (void) memcpy(gateway->frames + (uint32_t) slot * sizeof(message->as.consecutive_frame.data),
+                          message->as.consecutive_frame.data, data_length);
+            gateway->frame_used += 1;
+            gateway->credit -= 1;
+
+            source->receive_offset += data_length;
+            if (++(source->receive_sn) > 0x0F) {
+                source->receive_sn = 0;
+            }
+            source->receive_timer_cr = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+
+            if (source->receive_offset >= source->receive_size) {
+                /* all received, target drains the buffer */
+                source->receive_status = ISOTP_RECEIVE_STATUS_IDLE;
+            } else if (0 == gateway->credit) {
+                gateway->timer_wait = isotp_user_get_ms() + ISO_TP_RECEIVE_WAIT_INTERVAL;
+            }
+
+            /* cut through */
+            isotp_send_poll(target);
+            isotp_gateway_grant(gateway);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/* keep the source waiting while the target can not take more frames */
+static void isotp_gateway_poll(IsoTpGateway *gateway) {
+    IsoTpLink *source = gateway->source;
+
+    if (0 != gateway->pending_len) {
+        isotp_gateway_retry(gateway);
+    }
+
+    if (gateway->target->send_gateway != gateway ||
+        ISOTP_RECEIVE_STATUS_INPROGRESS != source->receive_status || 0 != gateway->credit) {
+        return;
+    }
+
+#if ISO_TP_RECEIVE_MAX_WFT_NUMBER > 0
+    if (source->receive_wft_count < ISO_TP_RECEIVE_MAX_WFT_NUMBER) {
+        if (IsoTpTimeAfter(isotp_user_get_ms(), gateway->timer_wait)) {
+            source->receive_wft_count += 1;
+            isotp_queue_flow_control(source, PCI_FLOW_STATUS_WAIT, 0, 0);
+            gateway->timer_wait = isotp_user_get_ms() + ISO_TP_RECEIVE_WAIT_INTERVAL;
+            /* source's N_Cr restarts with each flow control frame */
+            source->receive_timer_cr = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+        }
+        return;
+    }
+#endif
+
+    /* no FC.WAIT left, give up once N_Cr has passed without a grant as the sender would */
+    if (IsoTpTimeAfter(isotp_user_get_ms(), source->receive_timer_cr)) {
+        isotp_gateway_abort(gateway, ISOTP_PROTOCOL_RESULT_WFT_OVRN);
+    }
+}
+
+/* the earlier of two points in time, computed without signed overflow for far apart points */
+static uint32_t isotp_time_earliest(uint32_t a, uint32_t b) {
+    return (int32_t) (a - b) > 0 ? b : a;
+}
+
+/* time after which isotp_poll has work to do for the link, like the link's timers, returns 0 if it has none */
+static int isotp_poll_deadline(IsoTpLink *link, uint32_t now, uint32_t *deadline) {
+    uint32_t due;
+    int active;
+
+    due = now + ISOTP_LINK_TABLE_IDLE_TIME;
+    active = 0;
+
+    if (ISOTP_SEND_STATUS_INPROGRESS == link->send_status) {
+        active = 1;
+        due = isotp_time_earliest(due, link->send_timer_bs);
+
+        if (0 != link->send_pending) {
+            due = now - 1;
+        } else if (0x0 == link->send_scheduler &&
+                   (ISOTP_INVALID_BS == link->send_bs_remain || link->send_bs_remain > 0) &&
+                   (0x0 == link->send_gateway || 0 != link->send_gateway->frame_used)) {
+            due = isotp_time_earliest(due, 0 == link->send_st_min ? now - 1 : link->send_timer_st);
+        }
+    }
+
+    /* retries and waiting for a buffer are not timed */
+    if (0 != link->receive_fc_pending || 0 != link->receive_wait_size ||
+        (0x0 != link->receive_gateway && 0 != link->receive_gateway->pending_len)) {
+        active = 1;
+        due = now - 1;
+    }
+
+    if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status) {
+        active = 1;
+        due = isotp_time_earliest(due, link->receive_timer_cr);
+        if (0x0 != link->receive_gateway && 0 == link->receive_gateway->credit) {
+            due = isotp_time_earliest(due, link->receive_gateway->timer_wait);
+        }
+    }
+
+    *deadline = due;
+    return active;
+}
+
+/* index of the first deadline from index on that now is after, count if none */
+static uint32_t isotp_link_table_scan(const uint32_t *deadlines, uint32_t index, uint32_t count, uint32_t now) {
+    int due;
+
+#if defined(__AVX2__)
+    const __m256i now8 = _mm256_set1_epi32((int32_t) now);
+    const __m256i zero8 = _mm256_setzero_si256();
+
+    /* 8 links at a time, deadline - now < 0 means due */
+    while (index + 8 <= count) {
+        __m256i after = _mm256_cmpgt_epi32(
+            zero8, _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *) (deadlines + index)), now8));
+        due = _mm256_movemask_ps(_mm256_castsi256_ps(after));
+        if (0 != due) {
+            while (0 == (due & 1)) {
+                due >>= 1;
+                index++;
+            }
+            return index;
+        }
+        index += 8;
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    const __m128i now4 = _mm_set1_epi32((int32_t) now);
+    const __m128i zero4 = _mm_setzero_si128();
+
+    /* 4 links at a time, deadline - now < 0 means due */
+    while (index + 4 <= count) {
+        __m128i after = _mm_cmpgt_epi32(
+            zero4, _mm_sub_epi32(_mm_loadu_si128((const __m128i *) (deadlines + index)), now4));
+        due = _mm_movemask_ps(_mm_castsi128_ps(after));
+        if (0 != due) {
+            while (0 == (due & 1)) {
+                due >>= 1;
+                index++;
+            }
+            return index;
+        }
+        index += 4;
+    }
+#endif
+
+    /* remainder, or all links without SIMD */
+    (void) due;
+    for (; index < count; index++) {
+        if ((int32_t) (deadlines[index] - now) < 0) {
+            return index;
+        }
+    }
+
+    return count;
+}
+
+/* re-arm the link of the table at the address, if it is one */
+static void isotp_link_table_update_link(IsoTpLinkTable *table, const IsoTpLink *link) {
+    uintptr_t offset;
+
+    offset = (uintptr_t) link - (uintptr_t) table->links;
+    if (offset < (uintptr_t) table->count * sizeof(IsoTpLink)) {
+        isotp_link_table_update(table, (uint32_t) (offset / sizeof(IsoTpLink)));
+    }
+}
+
+/* re-arm a link after a frame or poll, and the other link of each gateway it was part of,
+   e.g. consecutive frames received by a source wait to be sent by the target */
+static void isotp_link_table_refresh(IsoTpLinkTable *table, uint32_t index, IsoTpGateway *send_gateway) {
+    IsoTpLink *link = &table->links[index];
+
+    isotp_link_table_update(table, index);
+    if (0x0 != link->receive_gateway) {
+        isotp_link_table_update_link(table, link->receive_gateway->target);
+    }
+    /* the target's gateway is left once its message ended */
+    if (0x0 != send_gateway) {
+        isotp_link_table_update_link(table, send_gateway->source);
+    }
+}
+
+///////////////////////////////////////////////////////
+///                 PUBLIC FUNCTIONS                ///
+///////////////////////////////////////////////////////
+
+int isotp_send(IsoTpLink *link, const uint8_t payload[], uint16_t size) {
+    return isotp_send_with_id(link, link->send_arbitration_id, payload, size);
+}
+
+int isotp_send_with_id(IsoTpLink *link, uint32_t id, const uint8_t payload[], uint16_t size) {
+    int ret;
+
+    if (link == 0x0) {
+        isotp_user_debug("Link is null!");
+        return ISOTP_RET_ERROR;
+    }
+
+    if (size > link->send_buf_size) {
+        isotp_user_debug("Message size too large. Increase ISO_TP_MAX_MESSAGE_SIZE to set a larger buffer\n");
+        char message[128];
+        sprintf(&message[0], "Attempted to send %d bytes; max size is %d!\n", size, link->send_buf_size);
+        return ISOTP_RET_OVERFLOW;
+    }
+
+    if (ISOTP_SEND_STATUS_INPROGRESS == link->send_status) {
+        isotp_user_debug("Abort previous message, transmission in progress.\n");
+        return ISOTP_RET_INPROGRESS;
+    }
+
+    /* copy into local buffer */
+    link->send_size = size;
+    link->send_offset = 0;
+    (void) memcpy(link->send_buffer, payload, size);
+
+    if (link->send_size < 8) {
+        /* send single frame */
+        ret = isotp_send_single_frame(link, id);
+        if (ISOTP_RET_OK == ret) {
+            link->send_protocol_result = ISOTP_PROTOCOL_RESULT_OK;
+            isotp_send_complete(link);
+        }
+    } else {
+        /* send multi-frame */
+        ret = isotp_send_first_frame(link, id);
+
+        /* init multi-frame control flags */
+        if (ISOTP_RET_OK == ret) {
+            isotp_send_start(link);
+        }
+    }
+
+    return ret;
+}
+
+int isotp_encode_frames(IsoTpFrameCache *cache, uint8_t *frames, uint16_t frame_count, const uint8_t payload[], uint16_t size) {
+    IsoTpCanMessage message;
+    uint16_t offset;
+    uint16_t data_length;
+    uint16_t index;
+    uint8_t sn;
+
+    if (size > 4095) {
+        return ISOTP_RET_LENGTH;
+    }
+
+    if (frame_count < ISOTP_FRAME_CACHE_FRAMES(size)) {
+        return ISOTP_RET_OVERFLOW;
+    }
+
+    cache->frames = frames;
+    cache->frame_count = ISOTP_FRAME_CACHE_FRAMES(size);
+    cache->size = size;
+
+    (void) memset(frames, 0, (uint32_t) cache->frame_count * sizeof(message));
+
+    if (size < 8) {
+        message.as.single_frame.type = ISOTP_PCI_TYPE_SINGLE;
+        message.as.single_frame.SF_DL = (uint8_t) size;
+        (void) memset(message.as.single_frame.data, 0, sizeof(message.as.single_frame.data));
+        (void) memcpy(message.as.single_frame.data, payload, size);
+        (void) memcpy(frames, message.as.data_array.ptr, sizeof(message));
+#ifdef ISO_TP_FRAME_PADDING
+        cache->last_frame_size = sizeof(message);
+#else
+        cache->last_frame_size = (uint8_t) (size + 1);
+#endif
+        return ISOTP_RET_OK;
+    }
+
+    message.as.first_frame.type = ISOTP_PCI_TYPE_FIRST_FRAME;
+    message.as.first_frame.FF_DL_low = (uint8_t) size;
+    message.as.first_frame.FF_DL_high = (uint8_t) (0x0F & (size >> 8));
+    (void) memcpy(message.as.first_frame.data, payload, sizeof(message.as.first_frame.data));
+    (void) memcpy(frames, message.as.data_array.ptr, sizeof(message));
+
+    offset = sizeof(message.as.first_frame.data);
+    sn = 1;
+    data_length = 0;
+    for (index = 1; index < cache->frame_count; index++) {
+        data_length = size - offset;
+        if (data_length > sizeof(message.as.consecutive_frame.data)) {
+            data_length = sizeof(message.as.consecutive_frame.data);
+        }
+
+        message.as.consecutive_frame.type = TSOTP_PCI_TYPE_CONSECUTIVE_FRAME;
+        message.as.consecutive_frame.SN = sn;
+        (void) memset(message.as.consecutive_frame.data, 0, sizeof(message.as.consecutive_frame.data));
+        (void) memcpy(message.as.consecutive_frame.data, payload + offset, data_length);
+        (void) memcpy(frames + (uint32_t) index * sizeof(message), message.as.data_array.ptr, sizeof(message));
+
+        offset += data_length;
+        sn = (sn + 1) & 0x0F;
+    }
+
+#ifdef ISO_TP_FRAME_PADDING
+    cache->last_frame_size = sizeof(message);
+#else
+    cache->last_frame_size = (uint8_t) (data_length + 1);
+#endif
+
+    return ISOTP_RET_OK;
+}
+
+int isotp_send_cached(IsoTpLink *link, const IsoTpFrameCache *cache) {
+    return isotp_send_cached_with_id(link, link->send_arbitration_id, cache);
+}
+
+int isotp_send_cached_with_id(IsoTpLink *link, uint32_t id, const IsoTpFrameCache *cache) {
+    IsoTpCanMessage message;
+    int ret;
+
+    if (link == 0x0) {
+        isotp_user_debug("Link is null!");
+        return ISOTP_RET_ERROR;
+    }
+
+    if (ISOTP_SEND_STATUS_INPROGRESS == link->send_status) {
+        isotp_user_debug("Abort previous message, transmission in progress.\n");
+        return ISOTP_RET_INPROGRESS;
+    }
+
+    link->send_size = cache->size;
+    link->send_offset = 0;
+
+    if (1 == cache->frame_count) {
+        /* send single frame */
+        ret = isotp_send_can(link, id, cache->frames, cache->last_frame_size);
+        if (ISOTP_RET_OK == ret) {
+            link->send_protocol_result = ISOTP_PROTOCOL_RESULT_OK;
+            isotp_send_complete(link);
+        }
+    } else {
+        /* send first frame, the consecutive frames follow from isotp_poll */
+        ret = isotp_send_can(link, id, cache->frames, sizeof(message));
+        if (ISOTP_RET_OK == ret) {
+            link->send_offset = sizeof(message.as.first_frame.data);
+            link->send_sn = 1;
+            link->send_cache = cache;
+            isotp_send_start(link);
+        }
+    }
+
+    return ret;
+}
+
+void isotp_on_can_message(IsoTpLink *link, uint8_t *data, uint8_t len) {
+    IsoTpCanMessage message;
+    int ret;
+    
+    if (len < 2 || len > 8) {
+        return;
+    }
+
+    memcpy(message.as.data_array.ptr, data, len);
+    memset(message.as.data_array.ptr + len, 0, sizeof(message.as.data_array.ptr) - len);
+
+    /* messages received by a gateway's source are forwarded */
+    if (0x0 != link->receive_gateway && ISOTP_PCI_TYPE_FLOW_CONTROL_FRAME != message.as.common.type) {
+        isotp_gateway_on_can_message(link->receive_gateway, &message, len);
+        return;
+    }
+
+    switch (message.as.common.type) {
+        case ISOTP_PCI_TYPE_SINGLE: {
+            /* update protocol result */
+            if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status) {
+                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_UNEXP_PDU;
+                isotp_notify_error(link, ISOTP_PROTOCOL_RESULT_UNEXP_PDU);
+            } else {
+                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_OK;
+            }
+
+            /* a waiting sender gave up, flow control of a replaced reception is obsolete */
+            link->receive_wait_size = 0;
+            link->receive_fc_pending = 0;
+
+            /* handle message */
+            ret = isotp_receive_single_frame(link, &message, len);
+            
+            if (ISOTP_RET_OK == ret) {
+                /* change status */
+                isotp_receive_complete(link);
+            } else if (ISOTP_RET_NO_BUFFER == ret) {
+                isotp_receive_abort(link, ISOTP_PROTOCOL_RESULT_BUFFER_OVFLW);
+            }
+            break;
+        }
+        case ISOTP_PCI_TYPE_FIRST_FRAME: {
+            /* update protocol result */
+            if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status) {
+                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_UNEXP_PDU;
+                isotp_notify_error(link, ISOTP_PROTOCOL_RESULT_UNEXP_PDU);
+            } else {
+                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_OK;
+            }
+
+            /* handle message, flow control of a replaced reception is obsolete */
+            link->receive_wait_size = 0;
+            link->receive_fc_pending = 0;
+            ret = isotp_receive_first_frame(link, &message, len);
+
+            /* no buffer available now, let the sender wait */
+            if (ISOTP_RET_NO_BUFFER == ret && ISO_TP_RECEIVE_MAX_WFT_NUMBER > 0) {
+                /* an unfinished reception is given up, an unread message is kept */
+                if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status) {
+                    link->receive_status = ISOTP_RECEIVE_STATUS_IDLE;
+                }
+                link->receive_wft_count = 1;
+                isotp_queue_flow_control(link, PCI_FLOW_STATUS_WAIT, 0, 0);
+                link->receive_timer_wait = isotp_user_get_ms() + ISO_TP_RECEIVE_WAIT_INTERVAL;
+                break;
+            }
+
+            /* if overflow happened */
+            if (ISOTP_RET_OVERFLOW == ret || ISOTP_RET_NO_BUFFER == ret) {
+                link->receive_wait_size = 0;
+                isotp_receive_abort(link, ISOTP_PROTOCOL_RESULT_BUFFER_OVFLW);
+                /* send error message, after the abort so that a refused one is retried */
+                isotp_queue_flow_control(link, PCI_FLOW_STATUS_OVERFLOW, 0, 0);
+                break;
+            }
+
+            /* if receive successful */
+            if (ISOTP_RET_OK == ret) {
+                isotp_receive_accept(link);
+            }
+            
+            break;
+        }
+        case TSOTP_PCI_TYPE_CONSECUTIVE_FRAME: {
+            /* check if in receiving status */
+            if (ISOTP_RECEIVE_STATUS_INPROGRESS != link->receive_status) {
+                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_UNEXP_PDU;
+                isotp_notify_error(link, ISOTP_PROTOCOL_RESULT_UNEXP_PDU);
+                break;
+            }
+
+            /* handle message */
+            ret = isotp_receive_consecutive_frame(link, &message, len);
+
+            /* if wrong sn */
+            if (ISOTP_RET_WRONG_SN == ret) {
+                isotp_receive_abort(link, ISOTP_PROTOCOL_RESULT_WRONG_SN);
+                break;
+            }
+
+            /* if success */
+            if (ISOTP_RET_OK == ret) {
+                /* refresh timer cs */
+                link->receive_timer_cr = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+                
                 /* receive finished */
                 if (link->receive_offset >= link->receive_size) {
-                    link->receive_status = ISOTP_RECEIVE_STATUS_FULL;
+                    isotp_receive_complete(link);
                 } else {
                     /* send fc when bs reaches limit */
                     if (0 == --link->receive_bs_count) {
                         link->receive_bs_count = ISO_TP_DEFAULT_BLOCK_SIZE;
-                        isotp_send_flow_control(link, PCI_FLOW_STATUS_CONTINUE, link->receive_bs_count, ISO_TP_DEFAULT_ST_MIN);
+                        isotp_queue_flow_control(link, PCI_FLOW_STATUS_CONTINUE, link->receive_bs_count, ISO_TP_DEFAULT_ST_MIN);
                     }
                 }
             }
@@ -399,8 +1299,7 @@ void isotp_on_can_message(IsoTpLink *link, uint8_t *data, uint8_t len) {
 
                 /* overflow */
                 if (PCI_FLOW_STATUS_OVERFLOW == message.as.flow_control.FS) {
-                    link->send_protocol_result = ISOTP_PROTOCOL_RESULT_BUFFER_OVFLW;
-                    link->send_status = ISOTP_SEND_STATUS_ERROR;
+                    isotp_send_abort(link, ISOTP_PROTOCOL_RESULT_BUFFER_OVFLW);
                 }
 
                 /* wait */
@@ -408,8 +1307,7 @@ void isotp_on_can_message(IsoTpLink *link, uint8_t *data, uint8_t len) {
                     link->send_wtf_count += 1;
                     /* wait exceed allowed count */
                     if (link->send_wtf_count > ISO_TP_MAX_WFT_NUMBER) {
-                        link->send_protocol_result = ISOTP_PROTOCOL_RESULT_WFT_OVRN;
-                        link->send_status = ISOTP_SEND_STATUS_ERROR;
+                        isotp_send_abort(link, ISOTP_PROTOCOL_RESULT_WFT_OVRN);
                     }
                 }
 
@@ -422,6 +1320,11 @@ void isotp_on_can_message(IsoTpLink *link, uint8_t *data, uint8_t len) {
                     }
                     link->send_st_min = isotp_st_min_to_ms(message.as.flow_control.STmin);
                     link->send_wtf_count = 0;
+
+                    /* pass the permission on to the source of a forwarded message */
+                    if (0x0 != link->send_gateway) {
+                        isotp_gateway_grant(link->send_gateway);
+                    }
                 }
             }
             break;
@@ -448,6 +1351,7 @@ int isotp_receive(IsoTpLink *link, uint8_t *payload, const uint16_t payload_size
     *out_size = copylen;
 
     link->receive_status = ISOTP_RECEIVE_STATUS_IDLE;
+    isotp_receive_buffer_release(link);
 
     return ISOTP_RET_OK;
 }
@@ -465,49 +1369,406 @@ void isotp_init_link(IsoTpLink *link, uint32_t sendid, uint8_t *sendbuf, uint16_
     return;
 }
 
-void isotp_poll(IsoTpLink *link) {
+void isotp_init_link_with_pool(IsoTpLink *link, uint32_t sendid, uint8_t *sendbuf, uint16_t sendbufsize, IsoTpBufferPool *pool) {
+    uint32_t capacity;
+
+    isotp_init_link(link, sendid, sendbuf, sendbufsize, 0x0, 0);
+
+    /* largest message the pool could ever hold */
+    capacity = (uint32_t) pool->block_size * pool->block_count;
+    if (capacity > 0xFFFF) {
+        capacity = 0xFFFF;
+    }
+    link->receive_pool = pool;
+    link->receive_buf_size = (uint16_t) capacity;
+
+    return;
+}
+
+void isotp_set_callbacks(IsoTpLink *link, const IsoTpCallbacks *callbacks, void *user_data) {
+    link->callbacks = callbacks;
+    link->callback_data = user_data;
+
+    return;
+}
+
+void isotp_init_gateway(IsoTpGateway *gateway, IsoTpLink *source, IsoTpLink *target, uint8_t *frames, uint16_t frame_count) {
+    memset(gateway, 0, sizeof(*gateway));
+    gateway->source = source;
+    gateway->target = target;
+    gateway->frames = frames;
+    gateway->frame_count = frame_count;
+    source->receive_gateway = gateway;
+
+    return;
+}
+
+void isotp_init_link_table(IsoTpLinkTable *table, IsoTpLink *links, uint32_t *deadlines, uint8_t *status, uint32_t count) {
+    uint32_t i;
+
+    table->links = links;
+    table->deadlines = deadlines;
+    table->status = status;
+    table->count = count;
+
+    for (i = 0; i < count; i++) {
+        isotp_link_table_update(table, i);
+    }
+
+    return;
+}
+
+void isotp_link_table_update(IsoTpLinkTable *table, uint32_t index) {
+    if (isotp_poll_deadline(&table->links[index], isotp_user_get_ms(), &table->deadlines[index])) {
+        table->status[index] = ISOTP_LINK_TABLE_ACTIVE;
+    } else {
+        table->status[index] = ISOTP_LINK_TABLE_IDLE;
+    }
+
+    return;
+}
+
+void isotp_link_table_on_can_message(IsoTpLinkTable *table, uint32_t index, uint8_t *data, uint8_t len) {
+    IsoTpGateway *send_gateway = table->links[index].send_gateway;
+
+    isotp_on_can_message(&table->links[index], data, len);
+    isotp_link_table_refresh(table, index, send_gateway);
+
+    return;
+}
+
+uint32_t isotp_link_table_poll(IsoTpLinkTable *table) {
+    IsoTpGateway *send_gateway;
+    uint32_t now;
+    uint32_t index;
+    uint32_t polled;
+
+    now = isotp_user_get_ms();
+    polled = 0;
+
+    index = isotp_link_table_scan(table->deadlines, 0, table->count, now);
+    while (index < table->count) {
+        /* idle links come up when their far deadline wraps, only re-arm them */
+        if (ISOTP_LINK_TABLE_ACTIVE == table->status[index]) {
+            send_gateway = table->links[index].send_gateway;
+            isotp_poll(&table->links[index]);
+            isotp_link_table_refresh(table, index, send_gateway);
+            polled++;
+        } else {
+            isotp_link_table_update(table, index);
+        }
+
+        index = isotp_link_table_scan(table->deadlines, index + 1, table->count, now);
+    }
+
+    return polled;
+}
+
+void isotp_init_fan_in(IsoTpFanIn *fan_in, IsoTpLink *request, IsoTpLink *responders, uint16_t capacity,
+                       IsoTpBufferPool *pool) {
+    memset(fan_in, 0, sizeof(*fan_in));
+    fan_in->request = request;
+    fan_in->responders = responders;
+    fan_in->capacity = capacity;
+    fan_in->pool = pool;
+    fan_in->status = ISOTP_FAN_IN_STATUS_IDLE;
+
+    return;
+}
+
+void isotp_set_fan_in_callbacks(IsoTpFanIn *fan_in,
+                                uint32_t (*flow_control_id)(uint32_t response_id, void *user_data),
+                                void (*complete)(IsoTpFanIn *fan_in, uint16_t count, void *user_data),
+                                void *user_data) {
+    fan_in->flow_control_id = flow_control_id;
+    fan_in->complete = complete;
+    fan_in->user_data = user_data;
+
+    return;
+}
+
+int isotp_fan_in_send(IsoTpFanIn *fan_in, uint32_t id, const uint8_t payload[], uint16_t size, uint32_t window_ms) {
+    uint16_t i;
     int ret;
 
-    /* only polling when operation in progress */
-    if (ISOTP_SEND_STATUS_INPROGRESS == link->send_status) {
+    if (ISOTP_FAN_IN_STATUS_INPROGRESS == fan_in->status) {
+        isotp_user_debug("Fan-in round in progress.\n");
+        return ISOTP_RET_INPROGRESS;
+    }
 
-        /* continue send data */
-        if (/* send data if bs_remain is invalid or bs_remain large than zero */
-        (ISOTP_INVALID_BS == link->send_bs_remain || link->send_bs_remain > 0) &&
-        /* and if st_min is zero or go beyond interval time */
-        (0 == link->send_st_min || (0 != link->send_st_min && IsoTpTimeAfter(isotp_user_get_ms(), link->send_timer_st)))) {
-            
-            ret = isotp_send_consecutive_frame(link);
-            if (ISOTP_RET_OK == ret) {
-                if (ISOTP_INVALID_BS != link->send_bs_remain) {
-                    link->send_bs_remain -= 1;
-                }
-                link->send_timer_bs = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
-                link->send_timer_st = isotp_user_get_ms() + link->send_st_min;
+    /* functional addressing allows single frames only */
+    if (size > 7) {
+        isotp_user_debug("Functional request of %d bytes does not fit a single frame.\n", size);
+        return ISOTP_RET_LENGTH;
+    }
 
-                /* check if send finish */
-                if (link->send_offset >= link->send_size) {
-                    link->send_status = ISOTP_SEND_STATUS_IDLE;
-                }
+    ret = isotp_send_with_id(fan_in->request, id, payload, size);
+    if (ISOTP_RET_OK != ret) {
+        return ret;
+    }
+
+    /* give back buffers of responses nobody read */
+    for (i = 0; i < fan_in->count; i++) {
+        isotp_receive_buffer_release(&fan_in->responders[i]);
+    }
+
+    fan_in->count = 0;
+    fan_in->dropped = 0;
+    fan_in->timer_window = isotp_user_get_ms() + window_ms;
+    fan_in->status = ISOTP_FAN_IN_STATUS_INPROGRESS;
+
+    return ret;
+}
+
+int isotp_fan_in_on_can_message(IsoTpFanIn *fan_in, uint32_t id, uint8_t *data, uint8_t len) {
+    IsoTpLink *responder;
+    uint32_t flow_control_id;
+    uint16_t i;
+    uint8_t type;
+
+    if (ISOTP_FAN_IN_STATUS_INPROGRESS != fan_in->status || len < 1) {
+        return ISOTP_RET_NO_DATA;
+    }
+
+    for (i = 0; i < fan_in->count; i++) {
+        if (fan_in->responders[i].receive_arbitration_id == id) {
+            isotp_on_can_message(&fan_in->responders[i], data, len);
+            return ISOTP_RET_OK;
+        }
+    }
+
+    /* a new responder starts with a single or first frame within the window */
+    type = data[0] >> 4;
+    if ((ISOTP_PCI_TYPE_SINGLE != type && ISOTP_PCI_TYPE_FIRST_FRAME != type) ||
+        IsoTpTimeAfter(isotp_user_get_ms(), fan_in->timer_window)) {
+        return ISOTP_RET_NO_DATA;
+    }
+
+    if (fan_in->count >= fan_in->capacity) {
+        fan_in->dropped++;
+        return ISOTP_RET_OVERFLOW;
+    }
+
+    if (0x0 != fan_in->flow_control_id) {
+        flow_control_id = fan_in->flow_control_id(id, fan_in->user_data);
+    } else {
+        flow_control_id = id - 8;
+    }
+
+    responder = &fan_in->responders[fan_in->count++];
+    isotp_init_link_with_pool(responder, flow_control_id, 0x0, 0, fan_in->pool);
+    responder->receive_arbitration_id = id;
+    isotp_on_can_message(responder, data, len);
+
+    return ISOTP_RET_OK;
+}
+
+void isotp_fan_in_poll(IsoTpFanIn *fan_in) {
+    uint16_t i;
+    int receiving;
+
+    isotp_poll(fan_in->request);
+
+    if (ISOTP_FAN_IN_STATUS_INPROGRESS != fan_in->status) {
+        return;
+    }
+
+    receiving = 0;
+    for (i = 0; i < fan_in->count; i++) {
+        isotp_poll(&fan_in->responders[i]);
+        if (ISOTP_RECEIVE_STATUS_INPROGRESS == fan_in->responders[i].receive_status ||
+            0 != fan_in->responders[i].receive_wait_size) {
+            receiving = 1;
+        }
+    }
+
+    if (!receiving && IsoTpTimeAfter(isotp_user_get_ms(), fan_in->timer_window)) {
+        fan_in->status = ISOTP_FAN_IN_STATUS_COMPLETE;
+        if (0x0 != fan_in->complete) {
+            fan_in->complete(fan_in, fan_in->count, fan_in->user_data);
+        }
+    }
+
+    return;
+}
+
+int isotp_fan_in_receive(IsoTpFanIn *fan_in, uint16_t index, uint32_t *id, uint8_t *payload,
+                         const uint16_t payload_size, uint16_t *out_size) {
+    if (index >= fan_in->count) {
+        return ISOTP_RET_NO_DATA;
+    }
+
+    *id = fan_in->responders[index].receive_arbitration_id;
+    return isotp_receive(&fan_in->responders[index], payload, payload_size, out_size);
+}
+
+void isotp_init_scheduler(IsoTpScheduler *scheduler, IsoTpLink **links, uint16_t capacity, uint32_t frames_per_second, uint16_t burst) {
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->links = links;
+    scheduler->link_capacity = capacity;
+    scheduler->frames_per_second = frames_per_second;
+    scheduler->burst = burst;
+    scheduler->tokens = (int32_t) burst * ISOTP_SCHEDULER_FRAME_COST;
+    scheduler->timer_refill = isotp_user_get_ms();
+
+    return;
+}
+
+int isotp_scheduler_add(IsoTpScheduler *scheduler, IsoTpLink *link, uint8_t priority) {
+    if (scheduler->link_count >= scheduler->link_capacity) {
+        isotp_user_debug("Scheduler is full.");
+        return ISOTP_RET_OVERFLOW;
+    }
+
+    if (priority >= ISO_TP_SCHEDULER_PRIORITIES) {
+        priority = ISO_TP_SCHEDULER_PRIORITIES - 1;
+    }
+
+    link->send_scheduler = scheduler;
+    link->send_priority = priority;
+    scheduler->links[scheduler->link_count++] = link;
+
+    return ISOTP_RET_OK;
+}
+
+void isotp_scheduler_poll(IsoTpScheduler *scheduler) {
+    IsoTpLink *link;
+    uint32_t now;
+    uint32_t elapsed;
+    int32_t limit;
+    uint16_t index;
+    uint16_t idle;
+    uint16_t i;
+    uint8_t priority;
+    int ret;
+
+    /* timeouts, reception and flow control of every link */
+    for (i = 0; i < scheduler->link_count; i++) {
+        isotp_poll(scheduler->links[i]);
+    }
+
+    /* refill token bucket */
+    if (0 != scheduler->frames_per_second) {
+        now = isotp_user_get_ms();
+        elapsed = now - scheduler->timer_refill;
+        scheduler->timer_refill = now;
+        if (elapsed > 1000) {
+            elapsed = 1000;
+        }
+        scheduler->tokens += (int32_t) (elapsed * scheduler->frames_per_second);
+        limit = (int32_t) scheduler->burst * ISOTP_SCHEDULER_FRAME_COST;
+        if (scheduler->tokens > limit) {
+            scheduler->tokens = limit;
+        }
+    }
+
+    /* higher priority classes first, round robin within a class */
+    for (priority = 0; priority < ISO_TP_SCHEDULER_PRIORITIES; priority++) {
+        index = scheduler->cursor[priority];
+        idle = 0;
+
+        /* until a whole round finds no link of this class ready */
+        while (idle < scheduler->link_count) {
+            /* bus load budget exhausted */
+            if (0 != scheduler->frames_per_second && scheduler->tokens < ISOTP_SCHEDULER_FRAME_COST) {
+                return;
+            }
+
+            if (index >= scheduler->link_count) {
+                index = 0;
+            }
+            link = scheduler->links[index++];
+
+            if (priority != link->send_priority || !isotp_send_ready(link)) {
+                idle++;
+                continue;
+            }
+
+            ret = isotp_send_next(link);
+            scheduler->cursor[priority] = index;
+
+            /* driver queue full, stop for now */
+            if (ISOTP_RET_BUSY == ret) {
+                return;
+            }
+
+            if (ISOTP_RET_OK == ret) {
+                idle = 0;
             } else {
-                link->send_status = ISOTP_SEND_STATUS_ERROR;
+                idle++;
             }
         }
+    }
 
-        /* check timeout */
-        if (IsoTpTimeAfter(isotp_user_get_ms(), link->send_timer_bs)) {
-            link->send_protocol_result = ISOTP_PROTOCOL_RESULT_TIMEOUT_BS;
-            link->send_status = ISOTP_SEND_STATUS_ERROR;
+    return;
+}
+
+void isotp_init_buffer_pool(IsoTpBufferPool *pool, uint8_t *memory, uint16_t *block_map, uint16_t block_size, uint16_t block_count) {
+    pool->memory = memory;
+    pool->block_map = block_map;
+    pool->block_size = block_size;
+    pool->block_count = block_count;
+    (void) memset(block_map, 0, sizeof(*block_map) * block_count);
+
+    return;
+}
+
+void isotp_poll(IsoTpLink *link) {
+
+    /* send consecutive frames */
+    isotp_send_poll(link);
+
+    /* forward a message */
+    if (0x0 != link->receive_gateway) {
+        isotp_gateway_poll(link->receive_gateway);
+    }
+
+    /* retry flow control frame refused by the driver */
+    if (0 != link->receive_fc_pending) {
+        if (IsoTpTimeAfter(isotp_user_get_ms(), link->receive_timer_ar)) {
+            link->receive_fc_pending = 0;
+            if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status) {
+                isotp_receive_abort(link, ISOTP_PROTOCOL_RESULT_TIMEOUT_A);
+            }
+        } else if (ISOTP_RET_OK == isotp_queue_flow_control(link, link->receive_fc_status,
+                                                           link->receive_fc_bs, link->receive_fc_st_min)) {
+            /* N_Cr starts when the flow control frame is out */
+            link->receive_timer_cr = isotp_user_get_ms() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT;
+        }
+    }
+
+    /* first frame waiting for a buffer */
+    if (0 != link->receive_wait_size) {
+
+        /* buffer became available, resume with CTS */
+        if (ISOTP_RECEIVE_STATUS_FULL != link->receive_status &&
+            ISOTP_RET_OK == isotp_receive_buffer_acquire(link, link->receive_wait_size)) {
+            isotp_receive_start(link, link->receive_wait_size, link->receive_wait_data);
+            isotp_receive_accept(link);
+        }
+
+        /* keep the sender waiting */
+        else if (IsoTpTimeAfter(isotp_user_get_ms(), link->receive_timer_wait)) {
+            if (link->receive_wft_count >= ISO_TP_RECEIVE_MAX_WFT_NUMBER) {
+                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_WFT_OVRN;
+                link->receive_wait_size = 0;
+                isotp_notify_error(link, ISOTP_PROTOCOL_RESULT_WFT_OVRN);
+            } else {
+                link->receive_wft_count += 1;
+                isotp_queue_flow_control(link, PCI_FLOW_STATUS_WAIT, 0, 0);
+                link->receive_timer_wait = isotp_user_get_ms() + ISO_TP_RECEIVE_WAIT_INTERVAL;
+            }
         }
     }
 
     /* only polling when operation in progress */
-    if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status) {
+    if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status && 0 == link->receive_fc_pending &&
+        /* a gateway's source is not timed while it waits for flow control */
+        (0x0 == link->receive_gateway || 0 != link->receive_gateway->credit)) {
         
         /* check timeout */
         if (IsoTpTimeAfter(isotp_user_get_ms(), link->receive_timer_cr)) {
-            link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_TIMEOUT_CR;
-            link->receive_status = ISOTP_RECEIVE_STATUS_IDLE;
+            isotp_receive_abort(link, ISOTP_PROTOCOL_RESULT_TIMEOUT_CR);
         }
     }
 
@@ -14,6 +14,52 @@ extern "C" {
 #include "isotp_config.h"
 #include "isotp_user.h"
 
+/**
+ * @brief Fixed-block pool from which links may take their receive buffer on demand.
+ * A message occupies as many consecutive blocks as needed to hold its length. The pool
+ * is not thread safe; links polled from different threads or interrupts should each
+ * use their own pool (one pool per shard).
+ */
+typedef struct IsoTpBufferPool {
+    uint8_t*                    memory;      /* block_count * block_size bytes */
+    uint16_t*                   block_map;   /* block_count entries, managed by the library */
+    uint16_t                    block_size;
+    uint16_t                    block_count;
+} IsoTpBufferPool;
+
+/**
+ * @brief A message encoded into its CAN frames once, to be sent any number of times with
+ * isotp_send_cached. The frames lie back to back, 8 bytes each, and can be handed to a DMA
+ * engine as they are.
+ */
+typedef struct IsoTpFrameCache {
+    uint8_t*                    frames;          /* frame_count * 8 bytes */
+    uint16_t                    frame_count;
+    uint16_t                    size;            /* payload size */
+    uint8_t                     last_frame_size; /* bytes sent of the last frame, all others are 8 */
+} IsoTpFrameCache;
+
+struct IsoTpLink;
+struct IsoTpGateway;
+struct IsoTpScheduler;
+
+/**
+ * @brief Optional notifications of a link, any member may be NULL.
+ * The callbacks are invoked from isotp_on_can_message and isotp_poll, except the completion of a
+ * single-frame transmission, which is reported from isotp_send. They may call isotp_send and
+ * isotp_receive on the link.
+ */
+typedef struct IsoTpCallbacks {
+    /* message was sent completely */
+    void (*tx_complete)(struct IsoTpLink *link, void *user_data);
+    /* message was received completely and can be read with isotp_receive */
+    void (*rx_complete)(struct IsoTpLink *link, uint16_t size, void *user_data);
+    /* first frame of a message of size bytes was accepted */
+    void (*rx_first_frame)(struct IsoTpLink *link, uint16_t size, void *user_data);
+    /* transfer failed, protocol_result is one of ISOTP_PROTOCOL_RESULT_* */
+    void (*protocol_error)(struct IsoTpLink *link, int protocol_result, void *user_data);
+} IsoTpCallbacks;
+
 /**
  * @brief Struct containing the data for linking an application to a CAN instance.
  * The data stored in this struct is used internally and may be used by software programs
@@ -36,6 +82,8 @@ typedef struct IsoTpLink {
     uint32_t                    send_timer_bs;  /* Time until reception of the next FlowControl N_PDU
                                                    start at sending FF, CF, receive FC
                                                    end at receive FC */
+    uint32_t                    send_timer_as;  /* Time until the driver must have accepted a pending frame */
+    uint8_t                     send_pending;   /* Last consecutive frame was refused with ISOTP_RET_BUSY */
     int                         send_protocol_result;
     uint8_t                     send_status;
 
@@ -44,6 +92,7 @@ typedef struct IsoTpLink {
     /* message buffer */
     uint8_t*                    receive_buffer;
     uint16_t                    receive_buf_size;
+    IsoTpBufferPool*            receive_pool;     /* when set, receive_buffer is taken from the pool per message */
     uint16_t                    receive_size;
     uint16_t                    receive_offset;
     /* multi-frame control */
@@ -53,9 +102,57 @@ typedef struct IsoTpLink {
                                                      start at sending FC, receive CF 
                                                      end at receive FC */
     int                         receive_protocol_result;
-    uint8_t                     receive_status;                                                     
+    uint8_t                     receive_status;
+    /* flow control wait */
+    uint8_t                     receive_wft_count;    /* FC.Wait frames sent in a row */
+    uint32_t                    receive_timer_wait;   /* Time to send the next FC.Wait frame */
+    uint16_t                    receive_wait_size;    /* FF_DL of a first frame waiting for a buffer, 0 if none */
+    uint8_t                     receive_wait_data[6]; /* Payload of that first frame */
+    /* flow control frame refused with ISOTP_RET_BUSY, retried by isotp_poll */
+    uint8_t                     receive_fc_pending;
+    uint8_t                     receive_fc_status;
+    uint8_t                     receive_fc_bs;
+    uint8_t                     receive_fc_st_min;
+    uint32_t                    receive_timer_ar;     /* Time until the driver must have accepted it */
+
+    /* notifications */
+    const IsoTpCallbacks*       callbacks;
+    void*                       callback_data;
+
+    /* forwarding */
+    struct IsoTpGateway*        receive_gateway;  /* received messages are forwarded by this gateway */
+    struct IsoTpGateway*        send_gateway;     /* gateway whose message is being sent */
+
+    /* transmit scheduling */
+    struct IsoTpScheduler*      send_scheduler;   /* sends this link's consecutive frames, if set */
+    uint8_t                     send_priority;    /* priority class, 0 is highest */                                                     
+
+    /* pre-encoded message being sent instead of send_buffer, if set */
+    const IsoTpFrameCache*      send_cache;
 } IsoTpLink;
 
+/**
+ * @brief Forwards messages received on one link to another one without waiting for the complete message.
+ * The first frame is passed on as soon as it arrives, and each consecutive frame as soon as the target's
+ * receiver permits. Flow control towards the source mirrors the target receiver's block size and STmin,
+ * bounded by the number of frames the gateway can buffer.
+ */
+typedef struct IsoTpGateway {
+    IsoTpLink*                  source;
+    IsoTpLink*                  target;
+    /* consecutive frame payloads received but not yet forwarded */
+    uint8_t*                    frames;       /* frame_count * 7 bytes */
+    uint16_t                    frame_count;
+    uint16_t                    frame_head;
+    uint16_t                    frame_used;
+    uint16_t                    credit;       /* frames granted to the source, not yet received */
+    uint32_t                    timer_wait;   /* Time to send the next FC.Wait frame to the source */
+    /* single or first frame refused with ISOTP_RET_BUSY by the target's driver */
+    uint8_t                     pending_frame[8];
+    uint8_t                     pending_len;  /* 0 if none */
+    uint32_t                    timer_as;     /* Time to give up the pending frame */
+} IsoTpGateway;
+
 /**
  * @brief Initialises the ISO-TP library.
  *
@@ -70,8 +167,250 @@ void isotp_init_link(IsoTpLink *link, uint32_t sendid,
                      uint8_t *sendbuf, uint16_t sendbufsize,
                      uint8_t *recvbuf, uint16_t recvbufsize);
 
+/**
+ * @brief Initialises a fixed-block buffer pool.
+ *
+ * @param pool The @code IsoTpBufferPool @endcode instance to initialise.
+ * @param memory A pointer to an area in memory of block_size * block_count bytes.
+ * @param block_map A pointer to an array of block_count entries used for bookkeeping.
+ * @param block_size The size of a single block.
+ * @param block_count The number of blocks.
+ */
+void isotp_init_buffer_pool(IsoTpBufferPool *pool, uint8_t *memory, uint16_t *block_map,
+                            uint16_t block_size, uint16_t block_count);
+
+/**
+ * @brief Initialises the ISO-TP library, see @link isotp_init_link @endlink.
+ * Instead of owning a receive buffer, the link takes a buffer sized to the incoming message
+ * from the pool when a single or first frame arrives, and returns it once the message has
+ * been read with isotp_receive or the reception failed.
+ *
+ * @param link The @code IsoTpLink @endcode instance used for transceiving data.
+ * @param sendid The ID used to send data to other CAN nodes.
+ * @param sendbuf A pointer to an area in memory which can be used as a buffer for data to be sent.
+ * @param sendbufsize The size of the buffer area.
+ * @param pool The pool receive buffers are taken from. May be shared between links.
+ */
+void isotp_init_link_with_pool(IsoTpLink *link, uint32_t sendid,
+                               uint8_t *sendbuf, uint16_t sendbufsize,
+                               IsoTpBufferPool *pool);
+
+/**
+ * @brief Table of many links polled in bulk.
+ * The time each link next needs isotp_poll and whether it has any transfer running are kept in
+ * arrays parallel to the links, so isotp_link_table_poll scans only these (with SIMD where the
+ * target supports SSE2 or AVX2) and polls just the links that are due.
+ */
+typedef struct IsoTpLinkTable {
+    IsoTpLink*                  links;
+    uint32_t*                   deadlines;  /* next time each link needs polling */
+    uint8_t*                    status;     /* ISOTP_LINK_TABLE_IDLE or ISOTP_LINK_TABLE_ACTIVE */
+    uint32_t                    count;
+} IsoTpLinkTable;
+
+/**
+ * @brief Initialises a link table over already initialised links.
+ *
+ * @param table The @code IsoTpLinkTable @endcode instance to initialise.
+ * @param links A pointer to an array of count links.
+ * @param deadlines A pointer to an array of count entries.
+ * @param status A pointer to an array of count entries.
+ * @param count The number of links.
+ */
+void isotp_init_link_table(IsoTpLinkTable *table, IsoTpLink *links, uint32_t *deadlines,
+                           uint8_t *status, uint32_t count);
+
+/**
+ * @brief Recomputes when a link of the table needs polling. Call it after anything other than
+ * isotp_link_table_on_can_message and isotp_link_table_poll changed the link, e.g. isotp_send.
+ * These two also recompute the other link of a gateway when it is in the same table.
+ *
+ * @param table The @code IsoTpLinkTable @endcode instance.
+ * @param index The index of the link in the table.
+ */
+void isotp_link_table_update(IsoTpLinkTable *table, uint32_t index);
+
+/**
+ * @brief See @link isotp_on_can_message @endlink, for a link of the table.
+ */
+void isotp_link_table_on_can_message(IsoTpLinkTable *table, uint32_t index, uint8_t *data, uint8_t len);
+
+/**
+ * @brief Polls all links of the table that are due.
+ *
+ * @param table The @code IsoTpLinkTable @endcode instance.
+ *
+ * @return The number of links polled.
+ */
+uint32_t isotp_link_table_poll(IsoTpLinkTable *table);
+
+/**
+ * @brief Sends one functional request and collects the responses of all ECUs answering it.
+ * A receive context, a link taking its buffer from the pool, is set up for each CAN ID a single or
+ * first frame arrives on during the response window, up to the number of contexts available. The
+ * round is complete once the window has passed and no response is still being received.
+ */
+typedef struct IsoTpFanIn {
+    IsoTpLink*                  request;      /* sends the functional request */
+    IsoTpLink*                  responders;   /* receive contexts, receive_arbitration_id is the responder */
+    uint16_t                    capacity;
+    uint16_t                    count;        /* responders of this round */
+    uint16_t                    dropped;      /* responders ignored, all contexts were taken */
+    IsoTpBufferPool*            pool;
+    uint32_t                    timer_window; /* Time until responses may start */
+    uint8_t                     status;
+    /* CAN ID flow control is sent to a responder with, NULL for the response ID - 8 of ISO 15765-4 */
+    uint32_t                    (*flow_control_id)(uint32_t response_id, void *user_data);
+    /* the round is complete, count responders have contexts */
+    void                        (*complete)(struct IsoTpFanIn *fan_in, uint16_t count, void *user_data);
+    void*                       user_data;
+} IsoTpFanIn;
+
+/**
+ * @brief Initialises a fan-in session.
+ *
+ * @param fan_in The @code IsoTpFanIn @endcode instance to initialise.
+ * @param request The link the request is sent with.
+ * @param responders A pointer to an array of capacity links, initialised by the session.
+ * @param capacity The maximum number of responders per round.
+ * @param pool The pool the responses are received into.
+ */
+void isotp_init_fan_in(IsoTpFanIn *fan_in, IsoTpLink *request, IsoTpLink *responders, uint16_t capacity,
+                       IsoTpBufferPool *pool);
+
+/**
+ * @brief Sets how flow control reaches a responder and what to call when a round is complete.
+ * Any of them may be NULL.
+ */
+void isotp_set_fan_in_callbacks(IsoTpFanIn *fan_in,
+                                uint32_t (*flow_control_id)(uint32_t response_id, void *user_data),
+                                void (*complete)(IsoTpFanIn *fan_in, uint16_t count, void *user_data),
+                                void *user_data);
+
+/**
+ * @brief Starts a round: sends a request with the given functional ID and collects responses for window_ms
+ * milliseconds. Responses of the previous round that were not read are discarded.
+ * Functional requests are single frames only, as no flow control can answer a functional first frame.
+ *
+ * @return ISOTP_RET_LENGTH if size does not fit a single frame (7 bytes),
+ *         ISOTP_RET_INPROGRESS if a round is running, otherwise the return value of isotp_send_with_id.
+ */
+int isotp_fan_in_send(IsoTpFanIn *fan_in, uint32_t id, const uint8_t payload[], uint16_t size, uint32_t window_ms);
+
+/**
+ * @brief Hands a received CAN frame to the session.
+ *
+ * @param fan_in The @code IsoTpFanIn @endcode instance.
+ * @param id The CAN ID the frame was received on.
+ * @param data The frame data.
+ * @param len The frame length.
+ *
+ * @return Possible return values:
+ *  - @code ISOTP_RET_OK @endcode if the frame belongs to a response
+ *  - @code ISOTP_RET_OVERFLOW @endcode if it starts a response no context was left for
+ *  - @code ISOTP_RET_NO_DATA @endcode if it is none of the session's business
+ */
+int isotp_fan_in_on_can_message(IsoTpFanIn *fan_in, uint32_t id, uint8_t *data, uint8_t len);
+
+/**
+ * @brief Polls the request link and all receive contexts, and completes the round when it is over.
+ */
+void isotp_fan_in_poll(IsoTpFanIn *fan_in);
+
+/**
+ * @brief Reads the response of a responder once the round is complete, see @link isotp_receive @endlink.
+ *
+ * @param fan_in The @code IsoTpFanIn @endcode instance.
+ * @param index The responder, less than the count reported on completion.
+ * @param id Set to the CAN ID the response was received on.
+ *
+ * @return ISOTP_RET_NO_DATA if the responder's response failed or was read already.
+ */
+int isotp_fan_in_receive(IsoTpFanIn *fan_in, uint16_t index, uint32_t *id, uint8_t *payload,
+                         const uint16_t payload_size, uint16_t *out_size);
+
+/**
+ * @brief Transmit scheduler for the links sharing one CAN channel.
+ * Consecutive frames of all links are sent by priority class, round robin within a class, while
+ * respecting each link's flow control (BS, STmin) and an optional token-bucket limit on the bus load.
+ */
+typedef struct IsoTpScheduler {
+    IsoTpLink**                 links;
+    uint16_t                    link_capacity;
+    uint16_t                    link_count;
+    uint16_t                    cursor[ISO_TP_SCHEDULER_PRIORITIES]; /* next link to serve per class */
+    /* bus load limit */
+    uint32_t                    frames_per_second; /* 0 for no limit */
+    uint16_t                    burst;             /* frames that may be sent back to back */
+    int32_t                     tokens;            /* in thousandths of a frame */
+    uint32_t                    timer_refill;      /* Last time tokens were added */
+} IsoTpScheduler;
+
+/**
+ * @brief Initialises a transmit scheduler.
+ *
+ * @param scheduler The @code IsoTpScheduler @endcode instance to initialise.
+ * @param links A pointer to an array of capacity link pointers, filled by isotp_scheduler_add.
+ * @param capacity The number of links that can be added.
+ * @param frames_per_second The bus load limit in frames per second, 0 for no limit. All frames of
+ *        the added links count against it, though only consecutive frames are held back.
+ * @param burst The number of frames that may be sent back to back after the bus was idle.
+ */
+void isotp_init_scheduler(IsoTpScheduler *scheduler, IsoTpLink **links, uint16_t capacity,
+                          uint32_t frames_per_second, uint16_t burst);
+
+/**
+ * @brief Adds a link to a scheduler. From then on, isotp_poll no longer sends the link's consecutive
+ * frames, isotp_scheduler_poll does.
+ *
+ * @param scheduler The @code IsoTpScheduler @endcode instance.
+ * @param link The @code IsoTpLink @endcode instance to add.
+ * @param priority The priority class, 0 is highest, up to ISO_TP_SCHEDULER_PRIORITIES - 1.
+ *
+ * @return Possible return values:
+ *  - @code ISOTP_RET_OK @endcode
+ *  - @code ISOTP_RET_OVERFLOW @endcode
+ */
+int isotp_scheduler_add(IsoTpScheduler *scheduler, IsoTpLink *link, uint8_t priority);
+
+/**
+ * @brief Polling function for all links of a scheduler; call it instead of isotp_poll for them.
+ *
+ * @param scheduler The @code IsoTpScheduler @endcode instance.
+ */
+void isotp_scheduler_poll(IsoTpScheduler *scheduler);
+
+/**
+ * @brief Initialises a cut-through gateway forwarding every message received on source to target.
+ * Frames received on source, other than flow control, must be passed to isotp_on_can_message on source,
+ * and flow control frames of the target's peer to isotp_on_can_message on target. Both links must be
+ * polled. Messages arriving while target is sending are rejected. A single or first frame that target's
+ * driver refuses with ISOTP_RET_BUSY is retried by isotp_poll on source for up to N_As. For the opposite
+ * direction, set up a second gateway with the links swapped.
+ *
+ * @param gateway The @code IsoTpGateway @endcode instance to initialise.
+ * @param source The link receiving the messages to forward. It receives no messages of its own.
+ * @param target The link sending the forwarded messages.
+ * @param frames A pointer to an area in memory of frame_count * 7 bytes buffering consecutive frames.
+ * @param frame_count The number of consecutive frames that can be buffered.
+ */
+void isotp_init_gateway(IsoTpGateway *gateway, IsoTpLink *source, IsoTpLink *target,
+                        uint8_t *frames, uint16_t frame_count);
+
+/**
+ * @brief Registers callbacks notifying the application of completed and failed transfers,
+ * so that send_status or isotp_receive need not be polled.
+ *
+ * @param link The @code IsoTpLink @endcode instance used for transceiving data.
+ * @param callbacks The callbacks to invoke, or NULL to remove them. Must stay valid while registered.
+ * @param user_data Passed to each callback.
+ */
+void isotp_set_callbacks(IsoTpLink *link, const IsoTpCallbacks *callbacks, void *user_data);
+
 /**
  * @brief Polling function; call this function periodically to handle timeouts, send consecutive frames, etc.
+ * Frames refused by isotp_user_send_can with ISOTP_RET_BUSY are retried here, so it may also be called
+ * when the CAN driver signals free transmit space.
  *
  * @param link The @code IsoTpLink @endcode instance used.
  */
@@ -101,7 +440,8 @@ void isotp_on_can_message(IsoTpLink *link, uint8_t *data, uint8_t len);
  *  - @code ISOTP_RET_OVERFLOW @endcode
  *  - @code ISOTP_RET_INPROGRESS @endcode
  *  - @code ISOTP_RET_OK @endcode
- *  - The return value of the user shim function isotp_user_send_can().
+ *  - The return value of the user shim function isotp_user_send_can(). On @code ISOTP_RET_BUSY @endcode
+ *    nothing was sent and the call may be repeated.
  */
 int isotp_send(IsoTpLink *link, const uint8_t payload[], uint16_t size);
 
@@ -110,6 +450,37 @@ int isotp_send(IsoTpLink *link, const uint8_t payload[], uint16_t size);
  */
 int isotp_send_with_id(IsoTpLink *link, uint32_t id, const uint8_t payload[], uint16_t size);
 
+/**
+ * @brief Encodes a message into the CAN frames that send it, for sending it repeatedly with
+ * isotp_send_cached without copying and encoding it again. The sequence is the same as isotp_send
+ * would produce, including padding.
+ *
+ * @param cache The @code IsoTpFrameCache @endcode instance to initialise.
+ * @param frames A pointer to frame_count * 8 bytes. ISOTP_FRAME_CACHE_FRAMES(size) frames are needed.
+ * @param frame_count The number of frames that fit into frames.
+ * @param payload The payload to be encoded. (Up to 4095 bytes).
+ * @param size The size of the payload.
+ *
+ * @return Possible return values:
+ *  - @code ISOTP_RET_OK @endcode
+ *  - @code ISOTP_RET_LENGTH @endcode if the payload is longer than 4095 bytes
+ *  - @code ISOTP_RET_OVERFLOW @endcode if frames is too small
+ */
+int isotp_encode_frames(IsoTpFrameCache *cache, uint8_t *frames, uint16_t frame_count,
+                        const uint8_t payload[], uint16_t size);
+
+/**
+ * @brief Sends a message encoded with isotp_encode_frames, see @link isotp_send @endlink.
+ * The link's send buffer is not used, and the cache must stay unchanged until the transmission ended.
+ * The consecutive frames are sent by isotp_poll, or by the link's scheduler.
+ */
+int isotp_send_cached(IsoTpLink *link, const IsoTpFrameCache *cache);
+
+/**
+ * @brief See @link isotp_send_cached @endlink, for functional addressing.
+ */
+int isotp_send_cached_with_id(IsoTpLink *link, uint32_t id, const IsoTpFrameCache *cache);
+
 /**
  * @brief Receives and parses the received data and copies the parsed data in to the internal buffer.
  * @param link The @link IsoTpLink @endlink instance used to transceive data.
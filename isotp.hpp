@@ -0,0 +1,332 @@
+#ifndef __ISOTP_HPP__
+#define __ISOTP_HPP__
+
+/*
+ * Optional C++20 interface to the library: links with embedded buffers sized at compile
+ * time, std::span based send and receive, and awaitables for coroutines. Header only,
+ * link against the library built from isotp.c as usual.
+ */
+
+#if __cplusplus < 202002L
+#error "isotp.hpp requires C++20"
+#endif
+
+#include <array>
+#include <chrono>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include "isotp.h"
+
+namespace isotp {
+
+/* library wide settings, fixed by isotp_config.h when isotp.c is compiled */
+inline constexpr std::size_t can_frame_size = 8;
+inline constexpr std::size_t single_frame_capacity = 7;
+inline constexpr std::size_t max_message_size = 4095;
+#ifdef ISO_TP_FRAME_PADDING
+inline constexpr bool frame_padding = true;
+#else
+inline constexpr bool frame_padding = false;
+#endif
+inline constexpr std::uint8_t block_size = ISO_TP_DEFAULT_BLOCK_SIZE;
+inline constexpr std::chrono::milliseconds st_min{ISO_TP_DEFAULT_ST_MIN};
+inline constexpr std::chrono::milliseconds response_timeout{ISO_TP_DEFAULT_RESPONSE_TIMEOUT};
+
+/**
+ * @brief Compile-time configuration of a link, e.g.
+ * @code
+ * struct DiagConfig {
+ *     static constexpr std::size_t send_buffer_size = 512;
+ *     static constexpr std::size_t receive_buffer_size = 4095;
+ * };
+ * @endcode
+ */
+template <typename Config>
+concept LinkConfig = requires {
+    { Config::send_buffer_size } -> std::convertible_to<std::size_t>;
+    { Config::receive_buffer_size } -> std::convertible_to<std::size_t>;
+} && Config::send_buffer_size <= max_message_size && Config::receive_buffer_size <= max_message_size;
+
+struct DefaultConfig {
+    static constexpr std::size_t send_buffer_size = 128;
+    static constexpr std::size_t receive_buffer_size = 128;
+};
+
+/**
+ * @brief Outcome of a transmission.
+ */
+struct SendResult {
+    int ret;                               /* ISOTP_RET_* of starting the transmission */
+    int protocol_result;                   /* ISOTP_PROTOCOL_RESULT_* of the transfer */
+
+    explicit operator bool() const { return ISOTP_RET_OK == ret && ISOTP_PROTOCOL_RESULT_OK == protocol_result; }
+};
+
+/**
+ * @brief Outcome of a reception.
+ */
+struct ReceiveResult {
+    int protocol_result;                   /* ISOTP_PROTOCOL_RESULT_* of the transfer */
+    std::span<const std::uint8_t> payload; /* in the link's buffer, valid until the link handles a frame or is polled */
+
+    explicit operator bool() const { return ISOTP_PROTOCOL_RESULT_OK == protocol_result; }
+};
+
+/**
+ * @brief A link with its buffers embedded, see @code ::IsoTpLink @endcode.
+ * Coroutines awaiting send() or receive() are resumed from on_can_message() and poll(), after
+ * the library has finished handling the frame, so a resumed coroutine may use or destroy the
+ * link. At most one coroutine may await each direction of a link at a time. Received messages are
+ * read in place from the link's receive buffer rather than copied, so a session costs no more RAM
+ * than its two buffers; copy a message before the link handles further frames if it is still needed.
+ * The link registers its own callbacks and can not be copied or moved.
+ */
+template <LinkConfig Config = DefaultConfig>
+class IsoTpLink {
+public:
+    static constexpr std::size_t send_buffer_size = Config::send_buffer_size;
+    static constexpr std::size_t receive_buffer_size = Config::receive_buffer_size;
+
+    explicit IsoTpLink(std::uint32_t send_id) {
+        isotp_init_link(&link_, send_id, send_buffer_.data(), send_buffer_size,
+                        receive_buffer_.data(), receive_buffer_size);
+        isotp_set_callbacks(&link_, &callbacks, this);
+    }
+
+    IsoTpLink(const IsoTpLink &) = delete;
+    IsoTpLink &operator=(const IsoTpLink &) = delete;
+
+    /* the underlying link, for the C API */
+    ::IsoTpLink *get() { return &link_; }
+
+    /**
+     * @brief See @link isotp_on_can_message @endlink, then resumes coroutines whose transfer ended.
+     */
+    void on_can_message(std::span<const std::uint8_t> frame) {
+        if (frame.size() <= can_frame_size) {
+            /* the frame is copied, not modified */
+            isotp_on_can_message(&link_, const_cast<std::uint8_t *>(frame.data()),
+                                 static_cast<std::uint8_t>(frame.size()));
+        }
+        resume();
+    }
+
+    /**
+     * @brief See @link isotp_poll @endlink, then resumes coroutines whose transfer ended.
+     */
+    void poll() {
+        isotp_poll(&link_);
+        resume();
+    }
+
+    /**
+     * @brief Starts sending a message, see @link isotp_send @endlink.
+     *
+     * @return ISOTP_RET_OK if the transmission was started, an error code otherwise.
+     */
+    int try_send(std::span<const std::uint8_t> payload) {
+        return try_send_with_id(link_.send_arbitration_id, payload);
+    }
+
+    int try_send_with_id(std::uint32_t id, std::span<const std::uint8_t> payload) {
+        if (payload.size() > send_buffer_size) {
+            return ISOTP_RET_OVERFLOW;
+        }
+        return isotp_send_with_id(&link_, id, payload.data(), static_cast<std::uint16_t>(payload.size()));
+    }
+
+    /**
+     * @brief Reads a received message without waiting, see @link isotp_receive @endlink.
+     *
+     * @return The message, empty if none was received. Valid until the link handles a frame or is polled.
+     */
+    std::span<const std::uint8_t> try_receive() {
+        if (!take_message()) {
+            return {};
+        }
+        return message();
+    }
+
+    /* awaiters keep their handle and result in the coroutine frame, not in the link */
+    class SendAwaiter {
+    public:
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            result_ = {link_.try_send_with_id(id_, payload_), ISOTP_PROTOCOL_RESULT_OK};
+            /* failed to start, or a single frame was sent right away */
+            if (ISOTP_RET_OK != result_.ret || ISOTP_SEND_STATUS_INPROGRESS != link_.link_.send_status) {
+                if (ISOTP_RET_OK == result_.ret) {
+                    result_.protocol_result = link_.link_.send_protocol_result;
+                }
+                return false;
+            }
+            handle_ = handle;
+            link_.send_waiter_ = this;
+            return true;
+        }
+
+        SendResult await_resume() const noexcept { return result_; }
+
+    private:
+        friend class IsoTpLink;
+        SendAwaiter(IsoTpLink &link, std::uint32_t id, std::span<const std::uint8_t> payload)
+            : link_(link), id_(id), payload_(payload) {}
+
+        IsoTpLink &link_;
+        std::uint32_t id_;
+        std::span<const std::uint8_t> payload_;
+        std::coroutine_handle<> handle_;
+        SendResult result_{};
+    };
+
+    class ReceiveAwaiter {
+    public:
+        bool await_ready() {
+            if (link_.take_message()) {
+                result_ = {ISOTP_PROTOCOL_RESULT_OK, link_.message()};
+                return true;
+            }
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) noexcept {
+            handle_ = handle;
+            link_.receive_waiter_ = this;
+        }
+
+        ReceiveResult await_resume() const noexcept { return result_; }
+
+    private:
+        friend class IsoTpLink;
+        explicit ReceiveAwaiter(IsoTpLink &link) : link_(link) {}
+
+        IsoTpLink &link_;
+        std::coroutine_handle<> handle_;
+        ReceiveResult result_{};
+    };
+
+    /**
+     * @brief Sends a message, to be awaited: @code SendResult r = co_await link.send(payload); @endcode
+     * The payload must stay valid until the transmission was started, i.e. until the await.
+     * A payload larger than the send buffer completes at once with ISOTP_RET_OVERFLOW.
+     * A payload held in a std::array is checked against the send buffer at compile time.
+     */
+    SendAwaiter send(std::span<const std::uint8_t> payload) {
+        return send_with_id(link_.send_arbitration_id, payload);
+    }
+
+    template <std::size_t Size>
+    SendAwaiter send(const std::array<std::uint8_t, Size> &payload) {
+        static_assert(Size <= send_buffer_size, "payload does not fit the send buffer");
+        return send_with_id(link_.send_arbitration_id, payload);
+    }
+
+    SendAwaiter send_with_id(std::uint32_t id, std::span<const std::uint8_t> payload) {
+        return SendAwaiter(*this, id, payload);
+    }
+
+    /**
+     * @brief Receives a message, to be awaited: @code ReceiveResult r = co_await link.receive(); @endcode
+     * Completes with an error if a reception that had started fails while waiting; stray frames
+     * of other transfers do not end the wait.
+     */
+    ReceiveAwaiter receive() { return ReceiveAwaiter(*this); }
+
+private:
+    /* read a complete message in place, the link receives the next one into the same buffer */
+    bool take_message() {
+        if (ISOTP_RECEIVE_STATUS_FULL != link_.receive_status) {
+            return false;
+        }
+        message_size_ = link_.receive_size;
+        link_.receive_status = ISOTP_RECEIVE_STATUS_IDLE;
+        return true;
+    }
+
+    std::span<const std::uint8_t> message() const { return {receive_buffer_.data(), message_size_}; }
+
+    void resume() {
+        std::coroutine_handle<> send;
+        std::coroutine_handle<> receive;
+
+        /* the first coroutine resumed may destroy the link, so nothing of it is used afterwards */
+        if (send_ready_) {
+            send = send_waiter_->handle_;
+            send_waiter_ = nullptr;
+            send_ready_ = false;
+        }
+        if (receive_ready_) {
+            receive = receive_waiter_->handle_;
+            receive_waiter_ = nullptr;
+            receive_ready_ = false;
+        }
+
+        if (send) {
+            send.resume();
+        }
+        if (receive) {
+            receive.resume();
+        }
+    }
+
+    static IsoTpLink &self(void *user_data) { return *static_cast<IsoTpLink *>(user_data); }
+
+    static void on_tx_complete(::IsoTpLink *, void *user_data) {
+        IsoTpLink &link = self(user_data);
+        if (link.send_waiter_ && !link.send_ready_) {
+            link.send_waiter_->result_.protocol_result = ISOTP_PROTOCOL_RESULT_OK;
+            link.send_ready_ = true;
+        }
+    }
+
+    static void on_rx_first_frame(::IsoTpLink *, std::uint16_t, void *user_data) {
+        self(user_data).receiving_ = true;
+    }
+
+    static void on_rx_complete(::IsoTpLink *, std::uint16_t, void *user_data) {
+        IsoTpLink &link = self(user_data);
+        link.receiving_ = false;
+        if (link.receive_waiter_ && !link.receive_ready_ && link.take_message()) {
+            link.receive_waiter_->result_ = {ISOTP_PROTOCOL_RESULT_OK, link.message()};
+            link.receive_ready_ = true;
+        }
+    }
+
+    static void on_protocol_error(::IsoTpLink *, int protocol_result, void *user_data) {
+        IsoTpLink &link = self(user_data);
+
+        /* a started reception was aborted, not a stray frame or one replacing the reception */
+        if (link.receiving_ && ISOTP_RECEIVE_STATUS_INPROGRESS != link.link_.receive_status) {
+            link.receiving_ = false;
+            if (link.receive_waiter_ && !link.receive_ready_) {
+                link.receive_waiter_->result_ = {protocol_result, {}};
+                link.receive_ready_ = true;
+            }
+        } else if (link.send_waiter_ && !link.send_ready_ && ISOTP_SEND_STATUS_ERROR == link.link_.send_status) {
+            link.send_waiter_->result_.protocol_result = protocol_result;
+            link.send_ready_ = true;
+        }
+    }
+
+    static constexpr IsoTpCallbacks callbacks = {on_tx_complete, on_rx_complete, on_rx_first_frame, on_protocol_error};
+
+    ::IsoTpLink link_;
+    std::array<std::uint8_t, send_buffer_size> send_buffer_{};
+    std::array<std::uint8_t, receive_buffer_size> receive_buffer_{};
+    std::uint16_t message_size_ = 0;
+
+    SendAwaiter *send_waiter_ = nullptr;
+    ReceiveAwaiter *receive_waiter_ = nullptr;
+    bool send_ready_ = false;
+    bool receive_ready_ = false;
+    bool receiving_ = false;
+};
+
+} /* namespace isotp */
+
+#endif /* __ISOTP_HPP__ */
@@ -16,11 +16,26 @@
  */
 #define ISO_TP_MAX_WFT_NUMBER       1
 
+/* This parameter indicate how many FC N_PDU WTs this receiver transmits in a
+ * row while no receive buffer is available, before giving up (WFTmax). When
+ * zero, the receiver never waits and answers with an overflow instead.
+ */
+#define ISO_TP_RECEIVE_MAX_WFT_NUMBER 0
+
+/* Interval between FC N_PDU WTs sent by this receiver, must be shorter than
+ * the sender's N_Bs timeout.
+ */
+#define ISO_TP_RECEIVE_WAIT_INTERVAL 50
+
 /* Private: The default timeout to use when waiting for a response during a
  * multi-frame send or receive.
  */
 #define ISO_TP_DEFAULT_RESPONSE_TIMEOUT 100
 
+/* Number of priority classes of the transmit scheduler.
+ */
+#define ISO_TP_SCHEDULER_PRIORITIES 4
+
 /* Private: Determines if by default, padding is added to ISO-TP message frames.
  */
 #define ISO_TP_FRAME_PADDING
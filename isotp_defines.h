@@ -39,10 +39,22 @@
 #define ISOTP_RET_NO_DATA      -5
 #define ISOTP_RET_TIMEOUT      -6
 #define ISOTP_RET_LENGTH       -7
+#define ISOTP_RET_NO_BUFFER    -8
+#define ISOTP_RET_BUSY         -9
 
 /* return logic true if 'a' is after 'b' */
 #define IsoTpTimeAfter(a,b) ((int32_t)((int32_t)(b) - (int32_t)(a)) < 0)
 
+/* link table status of a link */
+#define ISOTP_LINK_TABLE_IDLE      0
+#define ISOTP_LINK_TABLE_ACTIVE    1
+
+/* deadline of an idle link in a link table, as far ahead as IsoTpTimeAfter can tell */
+#define ISOTP_LINK_TABLE_IDLE_TIME 0x7FFFFFFF
+
+/* number of 8 byte frames a message of size bytes is sent in */
+#define ISOTP_FRAME_CACHE_FRAMES(size) ((size) < 8 ? 1 : 1 + (size) / 7)
+
 /*  invalid bs */
 #define ISOTP_INVALID_BS       0xFFFF
 
@@ -60,6 +72,13 @@ typedef enum {
     ISOTP_RECEIVE_STATUS_FULL,
 } IsoTpReceiveStatusTypes;
 
+/* ISOTP fan-in status */
+typedef enum {
+    ISOTP_FAN_IN_STATUS_IDLE,
+    ISOTP_FAN_IN_STATUS_INPROGRESS,
+    ISOTP_FAN_IN_STATUS_COMPLETE,
+} IsoTpFanInStatusTypes;
+
 /* can fram defination */
 #if defined(ISOTP_BYTE_ORDER_LITTLE_ENDIAN)
 typedef struct {
@@ -4,7 +4,9 @@
 /* user implemented, print debug message */
 void isotp_user_debug(const char* message, ...);
 
-/* user implemented, send can message. should return ISOTP_RET_OK when success.
+/* user implemented, send can message. should return ISOTP_RET_OK when success,
+ * or ISOTP_RET_BUSY when the frame cannot be queued right now (e.g. transmit
+ * mailbox full), in which case it is retried by isotp_poll.
 */
 int  isotp_user_send_can(const uint32_t arbitration_id,
                          const uint8_t* data, const uint8_t size);
@@ -0,0 +1,599 @@
+/*
+ * Replays a CAN trace through the library, offline and deterministically.
+ *
+ * Every CAN ID of the trace is received by a link of its own, in a link table, with the clock
+ * taken from the trace timestamps. Frames the links would send are dropped, the trace already
+ * holds the flow control of the real receivers. Reports the messages reassembled, the protocol
+ * errors, and the rate the frames were handled at.
+ *
+ * Reads candump log files, "(1436509052.249713) can0 7E8#0210AA", and Vector ASC files.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "isotp.h"
+
+#define REPLAY_MAX_IDS          8192
+#define REPLAY_HASH_SIZE        (REPLAY_MAX_IDS * 2)
+#define REPLAY_MAX_FILTERS      16
+#define REPLAY_MESSAGE_SIZE     4095
+#define REPLAY_ERROR_CODES      10
+
+typedef struct ReplayFrame {
+    uint32_t                    ms;     /* trace time since the first frame */
+    uint16_t                    link;   /* link receiving the frame's CAN ID */
+    uint8_t                     len;
+    uint8_t                     data[8];
+} ReplayFrame;
+
+typedef struct Replay {
+    /* trace */
+    ReplayFrame*                frames;
+    uint32_t                    frame_count;
+    uint32_t                    frame_capacity;
+    uint32_t                    skipped;
+    uint64_t                    first_us;
+    int                         started;
+    int                         asc_decimal;
+    /* CAN ID filters, all IDs if none */
+    uint32_t                    filter_low[REPLAY_MAX_FILTERS];
+    uint32_t                    filter_high[REPLAY_MAX_FILTERS];
+    int                         filter_count;
+    /* one link per CAN ID */
+    IsoTpLink*                  links;
+    uint32_t*                   ids;
+    uint8_t**                   buffers;
+    uint32_t*                   deadlines;
+    uint8_t*                    status;
+    uint16_t*                   hash;   /* link index + 1, 0 if free */
+    uint16_t                    link_count;
+    IsoTpLinkTable              table;
+    /* results */
+    int                         verbose;
+    uint32_t                    messages;
+    uint64_t                    message_bytes;
+    uint32_t                    errors[REPLAY_ERROR_CODES];
+    uint8_t                     message[REPLAY_MESSAGE_SIZE];
+} Replay;
+
+static Replay g_replay;
+static uint32_t g_now;
+
+static const char *g_error_names[REPLAY_ERROR_CODES] = {
+    "OK", "TIMEOUT_A", "TIMEOUT_BS", "TIMEOUT_CR", "WRONG_SN",
+    "INVALID_FS", "UNEXP_PDU", "WFT_OVRN", "BUFFER_OVFLW", "ERROR",
+};
+
+///////////////////////////////////////////////////////
+///                   USER SHIMS                    ///
+///////////////////////////////////////////////////////
+
+int isotp_user_send_can(const uint32_t arbitration_id, const uint8_t* data, const uint8_t size) {
+    (void) arbitration_id;
+    (void) data;
+    (void) size;
+    return ISOTP_RET_OK;
+}
+
+uint32_t isotp_user_get_ms(void) {
+    return g_now;
+}
+
+void isotp_user_debug(const char* message, ...) {
+    (void) message;
+}
+
+///////////////////////////////////////////////////////
+///                    CALLBACKS                    ///
+///////////////////////////////////////////////////////
+
+static void replay_rx_complete(IsoTpLink *link, uint16_t size, void *user_data) {
+    Replay *replay = (Replay *) user_data;
+    uint16_t out_size;
+    uint16_t i;
+
+    if (ISOTP_RET_OK != isotp_receive(link, replay->message, sizeof(replay->message), &out_size)) {
+        return;
+    }
+    replay->messages++;
+    replay->message_bytes += size;
+
+    if (replay->verbose) {
+        printf("%10u.%03u %8X %4u ", (unsigned) (g_now / 1000), (unsigned) (g_now % 1000),
+               (unsigned) replay->ids[link - replay->links], (unsigned) out_size);
+        for (i = 0; i < out_size && i < 32; i++) {
+            printf("%02X", replay->message[i]);
+        }
+        printf("%s\n", out_size > 32 ? "..." : "");
+    }
+}
+
+static void replay_protocol_error(IsoTpLink *link, int protocol_result, void *user_data) {
+    Replay *replay = (Replay *) user_data;
+    int code = -protocol_result;
+
+    if (code <= 0 || code >= REPLAY_ERROR_CODES) {
+        code = -ISOTP_PROTOCOL_RESULT_ERROR;
+    }
+    replay->errors[code]++;
+
+    if (replay->verbose) {
+        printf("%10u.%03u %8X error %s\n", (unsigned) (g_now / 1000), (unsigned) (g_now % 1000),
+               (unsigned) replay->ids[link - replay->links], g_error_names[code]);
+    }
+}
+
+static const IsoTpCallbacks g_callbacks = {
+    0x0, replay_rx_complete, 0x0, replay_protocol_error,
+};
+
+///////////////////////////////////////////////////////
+///                   TRACE LOADING                 ///
+///////////////////////////////////////////////////////
+
+static int replay_hex(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static const char *replay_skip_spaces(const char *p) {
+    while (' ' == *p || '\t' == *p) {
+        p++;
+    }
+    return p;
+}
+
+/* seconds with up to 6 decimals, as microseconds */
+static const char *replay_parse_time(const char *p, uint64_t *us) {
+    uint64_t seconds = 0;
+    uint32_t fraction = 0;
+    int digits = 0;
+
+    if (*p < '0' || *p > '9') {
+        return 0x0;
+    }
+    while (*p >= '0' && *p <= '9') {
+        seconds = seconds * 10 + (uint64_t) (*p++ - '0');
+    }
+    if ('.' == *p) {
+        p++;
+        while (*p >= '0' && *p <= '9') {
+            if (digits < 6) {
+                fraction = fraction * 10 + (uint32_t) (*p - '0');
+                digits++;
+            }
+            p++;
+        }
+    }
+    while (digits++ < 6) {
+        fraction *= 10;
+    }
+
+    *us = seconds * 1000000 + fraction;
+    return p;
+}
+
+static const char *replay_parse_number(const char *p, int base, uint32_t *value) {
+    const char *start = p;
+    int digit;
+
+    *value = 0;
+    while ((digit = replay_hex(*p)) >= 0 && digit < base) {
+        *value = *value * (uint32_t) base + (uint32_t) digit;
+        p++;
+    }
+    return p == start ? 0x0 : p;
+}
+
+static int replay_wanted(const Replay *replay, uint32_t id) {
+    int i;
+
+    if (0 == replay->filter_count) {
+        return 1;
+    }
+    for (i = 0; i < replay->filter_count; i++) {
+        if (id >= replay->filter_low[i] && id <= replay->filter_high[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* index of the link receiving id, set up on first sight, -1 if there are too many IDs */
+static int replay_link(Replay *replay, uint32_t id) {
+    uint32_t slot = (id * 2654435761u) % REPLAY_HASH_SIZE;
+    uint16_t index;
+
+    while (0 != replay->hash[slot]) {
+        if (replay->ids[replay->hash[slot] - 1] == id) {
+            return replay->hash[slot] - 1;
+        }
+        slot = (slot + 1) % REPLAY_HASH_SIZE;
+    }
+
+    if (replay->link_count >= REPLAY_MAX_IDS) {
+        return -1;
+    }
+
+    index = replay->link_count++;
+    replay->ids[index] = id;
+    replay->buffers[index] = (uint8_t *) malloc(REPLAY_MESSAGE_SIZE);
+    if (0x0 == replay->buffers[index]) {
+        replay->link_count--;
+        return -1;
+    }
+    replay->hash[slot] = (uint16_t) (index + 1);
+    return index;
+}
+
+static void replay_add(Replay *replay, uint64_t us, uint32_t id, const uint8_t *data, uint8_t len) {
+    ReplayFrame *frame;
+    int link;
+
+    if (!replay_wanted(replay, id)) {
+        return;
+    }
+
+    link = replay_link(replay, id);
+    if (link < 0) {
+        replay->skipped++;
+        return;
+    }
+
+    if (replay->frame_count == replay->frame_capacity) {
+        replay->frame_capacity = 0 == replay->frame_capacity ? 65536 : replay->frame_capacity * 2;
+        frame = (ReplayFrame *) realloc(replay->frames, replay->frame_capacity * sizeof(ReplayFrame));
+        if (0x0 == frame) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        replay->frames = frame;
+    }
+
+    if (!replay->started) {
+        replay->first_us = us;
+        replay->started = 1;
+    }
+
+    frame = &replay->frames[replay->frame_count++];
+    frame->ms = (uint32_t) ((us - replay->first_us) / 1000);
+    frame->link = (uint16_t) link;
+    frame->len = len;
+    memset(frame->data, 0, sizeof(frame->data));
+    memcpy(frame->data, data, len);
+}
+
+/* (1436509052.249713) can0 7E8#0210AA0000000000 */
+static int replay_parse_candump(Replay *replay, const char *p) {
+    uint64_t us;
+    uint32_t id;
+    uint8_t data[8];
+    uint8_t len = 0;
+    int high, low;
+
+    p = replay_parse_time(p + 1, &us);
+    if (0x0 == p || ')' != *p) {
+        return -1;
+    }
+
+    /* interface */
+    p = replay_skip_spaces(p + 1);
+    while ('\0' != *p && ' ' != *p && '\t' != *p) {
+        p++;
+    }
+
+    p = replay_parse_number(replay_skip_spaces(p), 16, &id);
+    if (0x0 == p || '#' != *p) {
+        return -1;
+    }
+
+    /* remote and CAN FD frames carry no ISO-TP data for classic CAN links */
+    p++;
+    if ('R' == *p || '#' == *p) {
+        return -1;
+    }
+
+    while ((high = replay_hex(p[0])) >= 0 && (low = replay_hex(p[1])) >= 0) {
+        if (len == sizeof(data)) {
+            return -1;
+        }
+        data[len++] = (uint8_t) ((high << 4) | low);
+        p += 2;
+    }
+
+    replay_add(replay, us, id, data, len);
+    return 0;
+}
+
+/*    0.004000 1  7E0             Tx   d 8 02 10 03 00 00 00 00 00 */
+static int replay_parse_asc(Replay *replay, const char *p) {
+    uint64_t us;
+    uint32_t channel;
+    uint32_t id;
+    uint32_t dlc;
+    uint32_t byte;
+    uint8_t data[8];
+    uint8_t len;
+
+    p = replay_parse_time(p, &us);
+    if (0x0 == p) {
+        return -1;
+    }
+
+    p = replay_parse_number(replay_skip_spaces(p), 10, &channel);
+    if (0x0 == p) {
+        return -1;
+    }
+
+    p = replay_parse_number(replay_skip_spaces(p), replay->asc_decimal ? 10 : 16, &id);
+    if (0x0 == p) {
+        return -1;
+    }
+    if ('x' == *p) {
+        p++;
+    }
+
+    /* Rx or Tx, then d for a data frame */
+    p = replay_skip_spaces(p);
+    if (0 != strncmp(p, "Rx", 2) && 0 != strncmp(p, "Tx", 2)) {
+        return -1;
+    }
+    p = replay_skip_spaces(p + 2);
+    if ('d' != *p) {
+        return -1;
+    }
+
+    p = replay_parse_number(replay_skip_spaces(p + 1), 16, &dlc);
+    if (0x0 == p || dlc > sizeof(data)) {
+        return -1;
+    }
+
+    for (len = 0; len < dlc; len++) {
+        p = replay_parse_number(replay_skip_spaces(p), 16, &byte);
+        if (0x0 == p || byte > 0xFF) {
+            return -1;
+        }
+        data[len] = (uint8_t) byte;
+    }
+
+    replay_add(replay, us, id, data, len);
+    return 0;
+}
+
+static int replay_load(Replay *replay, const char *path) {
+    char line[512];
+    const char *p;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (0x0 == file) {
+        perror(path);
+        return -1;
+    }
+
+    while (0x0 != fgets(line, sizeof(line), file)) {
+        p = replay_skip_spaces(line);
+        if ('(' == *p) {
+            if (0 != replay_parse_candump(replay, p)) {
+                replay->skipped++;
+            }
+        } else if (*p >= '0' && *p <= '9') {
+            if (0 != replay_parse_asc(replay, p)) {
+                replay->skipped++;
+            }
+        } else if (0 == strncmp(p, "base ", 5)) {
+            replay->asc_decimal = 0 == strncmp(replay_skip_spaces(p + 5), "dec", 3);
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+///////////////////////////////////////////////////////
+///                      REPLAY                     ///
+///////////////////////////////////////////////////////
+
+static void replay_reset(Replay *replay) {
+    uint16_t i;
+
+    for (i = 0; i < replay->link_count; i++) {
+        isotp_init_link(&replay->links[i], 0, 0x0, 0, replay->buffers[i], REPLAY_MESSAGE_SIZE);
+        isotp_set_callbacks(&replay->links[i], &g_callbacks, replay);
+    }
+    isotp_init_link_table(&replay->table, replay->links, replay->deadlines, replay->status, replay->link_count);
+    g_now = 0;
+}
+
+/* let time pass until ms, stopping at each deadline on the way so that timeouts fire when they expire */
+static void replay_advance(Replay *replay, uint32_t ms) {
+    const IsoTpLinkTable *table = &replay->table;
+    uint32_t next;
+    uint32_t due;
+    uint32_t i;
+
+    while ((int32_t) (ms - g_now) > 0) {
+        next = ms;
+        for (i = 0; i < table->count; i++) {
+            /* a link is due once the clock is after its deadline */
+            due = table->deadlines[i] + 1;
+            if (ISOTP_LINK_TABLE_ACTIVE == table->status[i] &&
+                (int32_t) (due - g_now) > 0 && (int32_t) (due - next) < 0) {
+                next = due;
+            }
+        }
+        g_now = next;
+        isotp_link_table_poll(&replay->table);
+    }
+
+    /* a trace going back in time */
+    if (ms != g_now) {
+        g_now = ms;
+        isotp_link_table_poll(&replay->table);
+    }
+}
+
+static void replay_run(Replay *replay) {
+    const ReplayFrame *frame;
+    uint32_t i;
+
+    for (i = 0; i < replay->frame_count; i++) {
+        frame = &replay->frames[i];
+
+        /* time passes first, so that timeouts fire in trace order */
+        replay_advance(replay, frame->ms);
+
+        isotp_link_table_on_can_message(&replay->table, frame->link, (uint8_t *) frame->data, frame->len);
+    }
+
+    /* receptions cut off by the end of the trace time out */
+    replay_advance(replay, g_now + 10 * ISO_TP_DEFAULT_RESPONSE_TIMEOUT);
+}
+
+static int replay_add_filter(Replay *replay, const char *arg) {
+    uint32_t low, high;
+    const char *p;
+
+    if (replay->filter_count == REPLAY_MAX_FILTERS) {
+        return -1;
+    }
+
+    p = replay_parse_number(arg, 16, &low);
+    if (0x0 == p) {
+        return -1;
+    }
+    high = low;
+    if ('-' == *p) {
+        p = replay_parse_number(p + 1, 16, &high);
+        if (0x0 == p) {
+            return -1;
+        }
+    }
+    if ('\0' != *p || high < low) {
+        return -1;
+    }
+
+    replay->filter_low[replay->filter_count] = low;
+    replay->filter_high[replay->filter_count] = high;
+    replay->filter_count++;
+    return 0;
+}
+
+static void replay_usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-v] [-r repeat] [-i id[-id]]... trace\n"
+            "  trace       candump log file or Vector ASC file\n"
+            "  -i id[-id]  replay only these hex CAN IDs, may be given up to %d times\n"
+            "  -r repeat   replay the trace this many times, for profiling\n"
+            "  -v          print each message and protocol error\n",
+            name, REPLAY_MAX_FILTERS);
+}
+
+int main(int argc, char **argv) {
+    Replay *replay = &g_replay;
+    const char *path = 0x0;
+    uint32_t repeat = 1;
+    uint32_t errors;
+    uint32_t r;
+    clock_t start;
+    double seconds;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (0 == strcmp(argv[i], "-v")) {
+            replay->verbose = 1;
+        } else if (0 == strcmp(argv[i], "-r") && i + 1 < argc) {
+            repeat = (uint32_t) strtoul(argv[++i], 0x0, 10);
+        } else if (0 == strcmp(argv[i], "-i") && i + 1 < argc) {
+            if (0 != replay_add_filter(replay, argv[++i])) {
+                replay_usage(argv[0]);
+                return 2;
+            }
+        } else if ('-' != argv[i][0] && 0x0 == path) {
+            path = argv[i];
+        } else {
+            replay_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (0x0 == path || 0 == repeat) {
+        replay_usage(argv[0]);
+        return 2;
+    }
+
+    replay->links = (IsoTpLink *) calloc(REPLAY_MAX_IDS, sizeof(IsoTpLink));
+    replay->ids = (uint32_t *) calloc(REPLAY_MAX_IDS, sizeof(uint32_t));
+    replay->buffers = (uint8_t **) calloc(REPLAY_MAX_IDS, sizeof(uint8_t *));
+    replay->deadlines = (uint32_t *) calloc(REPLAY_MAX_IDS, sizeof(uint32_t));
+    replay->status = (uint8_t *) calloc(REPLAY_MAX_IDS, sizeof(uint8_t));
+    replay->hash = (uint16_t *) calloc(REPLAY_HASH_SIZE, sizeof(uint16_t));
+    if (0x0 == replay->links || 0x0 == replay->ids || 0x0 == replay->buffers ||
+        0x0 == replay->deadlines || 0x0 == replay->status || 0x0 == replay->hash) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    if (0 != replay_load(replay, path)) {
+        return 1;
+    }
+
+    /* only the library's handling of the frames is timed, parsing the trace is not */
+    start = clock();
+    for (r = 0; r < repeat; r++) {
+        replay_reset(replay);
+        replay_run(replay);
+        if (0 == r) {
+            replay->verbose = 0;
+        }
+    }
+    seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    errors = 0;
+    for (i = 1; i < REPLAY_ERROR_CODES; i++) {
+        errors += replay->errors[i];
+    }
+
+    printf("frames:    %u (%u lines skipped)\n", (unsigned) replay->frame_count, (unsigned) replay->skipped);
+    printf("ids:       %u\n", (unsigned) replay->link_count);
+    printf("duration:  %u.%03u s of trace\n",
+           replay->frame_count > 0 ? (unsigned) (replay->frames[replay->frame_count - 1].ms / 1000) : 0u,
+           replay->frame_count > 0 ? (unsigned) (replay->frames[replay->frame_count - 1].ms % 1000) : 0u);
+    printf("messages:  %u (%llu bytes)\n", (unsigned) (replay->messages / repeat),
+           (unsigned long long) (replay->message_bytes / repeat));
+    printf("errors:    %u\n", (unsigned) (errors / repeat));
+    for (i = 1; i < REPLAY_ERROR_CODES; i++) {
+        if (0 != replay->errors[i]) {
+            printf("  %-13s %u\n", g_error_names[i], (unsigned) (replay->errors[i] / repeat));
+        }
+    }
+    if (seconds > 0) {
+        printf("rate:      %.0f frames/s (%u x %u frames in %.3f s)\n",
+               (double) replay->frame_count * repeat / seconds, (unsigned) repeat,
+               (unsigned) replay->frame_count, seconds);
+    } else {
+        printf("rate:      too fast to measure, use -r\n");
+    }
+
+    for (i = 0; i < replay->link_count; i++) {
+        free(replay->buffers[i]);
+    }
+    free(replay->frames);
+    free(replay->hash);
+    free(replay->status);
+    free(replay->deadlines);
+    free(replay->buffers);
+    free(replay->ids);
+    free(replay->links);
+
+    return 0;
+}